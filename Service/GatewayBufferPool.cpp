@@ -0,0 +1,151 @@
+#include "pch.h"
+#include "GatewayBufferPool.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBufferPool
+//
+
+GatewayBufferPool::SizeClass GatewayBufferPool::sm_sizeClasses[GatewayBufferPool::SIZE_CLASS_COUNT];
+thread_local GatewayBufferPool::ThreadCache GatewayBufferPool::st_threadCache;
+
+std::atomic<size_t> GatewayBufferPool::sm_checkoutCount{ 0 };
+std::atomic<size_t> GatewayBufferPool::sm_checkoutBytes{ 0 };
+std::atomic<size_t> GatewayBufferPool::sm_highWaterBytes{ 0 };
+std::atomic<size_t> GatewayBufferPool::sm_slabBytes{ 0 };
+
+
+char *GatewayBufferPool::Alloc(size_t size)
+{
+	char *buffer;
+	size_t capacity = GetCapacity(size);
+
+	if (capacity > MAX_BUFFER_SIZE)
+	{
+		// Oversized buffers bypass the slabs.
+		buffer = new char[capacity];
+	}
+	else
+	{
+		size_t sizeClass = GetSizeClass(capacity);
+		std::vector<char *> &freeList = st_threadCache.m_freeLists[sizeClass];
+
+		if (freeList.empty())
+		{
+			Refill(sizeClass, freeList);
+		}
+
+		buffer = freeList.back();
+		freeList.pop_back();
+	}
+
+	sm_checkoutCount++;
+	Checkout(capacity);
+
+	return buffer;
+}
+
+void GatewayBufferPool::Free(char *buffer, size_t size)
+{
+	if (!buffer)
+	{
+		return;
+	}
+
+	size_t capacity = GetCapacity(size);
+
+	sm_checkoutCount--;
+	Checkout(-static_cast<ptrdiff_t>(capacity));
+
+	if (capacity > MAX_BUFFER_SIZE)
+	{
+		delete[] buffer;
+		return;
+	}
+
+	size_t sizeClass = GetSizeClass(capacity);
+	std::vector<char *> &freeList = st_threadCache.m_freeLists[sizeClass];
+
+	freeList.push_back(buffer);
+
+	// Keep the thread cache bounded; hand half of it back to other threads.
+	size_t maxCount = std::max<size_t>(THREAD_CACHE_SIZE / capacity, 4);
+	if (freeList.size() > maxCount)
+	{
+		Drain(sizeClass, freeList, maxCount / 2);
+	}
+}
+
+
+void GatewayBufferPool::Refill(size_t sizeClass, std::vector<char *> &freeList)
+{
+	SizeClass &shared = sm_sizeClasses[sizeClass];
+	size_t capacity = MIN_BUFFER_SIZE << sizeClass;
+	size_t batchCount = std::max<size_t>(SLAB_SIZE / capacity, 1);
+
+	SyncLock lock(shared.m_mutex);
+
+	if (shared.m_freeList.empty())
+	{
+		// Carve a new slab; slabs are kept for the lifetime of the process.
+		char *slab = new char[batchCount * capacity];
+		shared.m_slabs.push_back(slab);
+		sm_slabBytes += batchCount * capacity;
+
+		for (size_t index = 0; index < batchCount; ++index)
+		{
+			shared.m_freeList.push_back(slab + (index * capacity));
+		}
+	}
+
+	size_t count = std::min(batchCount, shared.m_freeList.size());
+	freeList.insert(freeList.end(), shared.m_freeList.end() - count, shared.m_freeList.end());
+	shared.m_freeList.resize(shared.m_freeList.size() - count);
+}
+
+void GatewayBufferPool::Drain(size_t sizeClass, std::vector<char *> &freeList, size_t keepCount)
+{
+	SizeClass &shared = sm_sizeClasses[sizeClass];
+
+	SyncLock lock(shared.m_mutex);
+
+	shared.m_freeList.insert(shared.m_freeList.end(), freeList.begin() + keepCount, freeList.end());
+	freeList.resize(keepCount);
+}
+
+void GatewayBufferPool::Checkout(ptrdiff_t bytes)
+{
+	size_t checkoutBytes = (sm_checkoutBytes += bytes);
+
+	size_t highWaterBytes = sm_highWaterBytes;
+	while ((checkoutBytes > highWaterBytes) && !sm_highWaterBytes.compare_exchange_weak(highWaterBytes, checkoutBytes))
+	{
+	}
+}
+
+
+void GatewayBufferPool::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	writer.add("gateway_buffer_checkout_count", sm_checkoutCount);
+	writer.add("gateway_buffer_checkout_bytes", sm_checkoutBytes);
+	writer.add("gateway_buffer_high_water_bytes", sm_highWaterBytes);
+	writer.add("gateway_buffer_slab_bytes", sm_slabBytes);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBufferPool::ThreadCache
+//
+
+GatewayBufferPool::ThreadCache::~ThreadCache()
+{
+	// Return cached buffers when an I/O thread exits.
+	for (size_t sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; ++sizeClass)
+	{
+		if (!m_freeLists[sizeClass].empty())
+		{
+			Drain(sizeClass, m_freeLists[sizeClass], 0);
+		}
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBufferPool
+//
+// Gateway-wide pool of fixed-size I/O buffers carved from slabs. Sizes are
+// rounded up to a power of two; each thread keeps a small cache per size
+// so that checkouts on the I/O path rarely touch the shared free lists.
+//
+
+class GatewayBufferPool
+{
+public:
+	static const size_t MIN_BUFFER_SIZE = 4096;
+	static const size_t MAX_BUFFER_SIZE = 1048576;
+
+	static size_t GetCapacity(size_t size);
+
+	static char *Alloc(size_t size);
+	static void Free(char *buffer, size_t size);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	static const size_t SIZE_CLASS_COUNT = 9;
+	static const size_t SLAB_SIZE = 262144;
+	static const size_t THREAD_CACHE_SIZE = 1048576;
+
+	struct SizeClass
+	{
+		SyncMutex m_mutex;
+		std::vector<char *> m_freeList;
+		std::vector<char *> m_slabs;
+	};
+
+	class ThreadCache
+	{
+	public:
+		~ThreadCache();
+
+		std::vector<char *> m_freeLists[SIZE_CLASS_COUNT];
+	};
+
+	static SizeClass sm_sizeClasses[SIZE_CLASS_COUNT];
+	static thread_local ThreadCache st_threadCache;
+
+	static std::atomic<size_t> sm_checkoutCount;
+	static std::atomic<size_t> sm_checkoutBytes;
+	static std::atomic<size_t> sm_highWaterBytes;
+	static std::atomic<size_t> sm_slabBytes;
+
+	static size_t GetSizeClass(size_t size);
+	static void Refill(size_t sizeClass, std::vector<char *> &freeList);
+	static void Drain(size_t sizeClass, std::vector<char *> &freeList, size_t keepCount);
+	static void Checkout(ptrdiff_t bytes);
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline size_t GatewayBufferPool::GetSizeClass(size_t size)
+{
+	size_t sizeClass = 0;
+	for (size_t capacity = MIN_BUFFER_SIZE; capacity < size; capacity <<= 1)
+	{
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+inline size_t GatewayBufferPool::GetCapacity(size_t size)
+{
+	return size > MAX_BUFFER_SIZE ? size : (MIN_BUFFER_SIZE << GetSizeClass(size));
+}
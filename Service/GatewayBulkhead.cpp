@@ -0,0 +1,263 @@
+#include "pch.h"
+#include "GatewayContext.h"
+#include "GatewayBulkhead.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBulkhead
+//
+
+SyncMutex GatewayBulkhead::sm_bulkheadMutex;
+std::set<GatewayBulkhead*> GatewayBulkhead::sm_bulkheads;
+
+
+GatewayBulkhead::Ticket::~Ticket()
+{
+}
+
+
+GatewayBulkhead::GatewayBulkhead(const String &labels, size_t maxInFlight, size_t maxQueued, size_t maxThreads, unsigned queueTimeout) :
+	m_labels(labels),
+	m_maxInFlight(maxInFlight),
+	m_maxQueued(maxQueued),
+	m_maxThreads(maxThreads),
+	m_queueTimeout(queueTimeout)
+{
+	SyncLock lock(sm_bulkheadMutex);
+	sm_bulkheads.insert(this);
+}
+
+GatewayBulkhead::~GatewayBulkhead()
+{
+	SyncLock lock(sm_bulkheadMutex);
+	sm_bulkheads.erase(this);
+}
+
+
+bool GatewayBulkhead::dispatch(GatewayContext *context, task_t &&task, TicketPtr &ticket)
+{
+	TicketPtr pending = new Ticket;
+	pending->m_context = context;
+	pending->m_task = std::move(task);
+
+	{
+		SyncLock lock(m_mutex);
+
+		if (m_maxInFlight && (m_inFlight >= m_maxInFlight))
+		{
+			if (m_waiting.size() >= m_maxQueued)
+			{
+				m_shedCount++;
+				return false;
+			}
+
+			ticket = pending;
+			m_waiting.push_back(pending);
+
+			if (m_queueTimeout)
+			{
+				GatewayBulkheadPtr self = this;
+
+				context->postAfter(
+					m_queueTimeout,
+					[this, self, pending]() mutable
+					{
+						expire(pending);
+					}
+				);
+			}
+			return true;
+		}
+
+		m_inFlight++;
+		ticket = pending;
+
+		if (!admit(pending))
+		{
+			return true;
+		}
+	}
+
+	run(std::move(pending));
+	return true;
+}
+
+void GatewayBulkhead::release(Ticket *ticket)
+{
+	TicketPtr next;
+
+	{
+		SyncLock lock(m_mutex);
+
+		switch (ticket->m_state)
+		{
+		case Ticket::State::WAITING:
+			// Torn down before it got a slot, so there is none to hand on.
+			Remove(m_waiting, ticket);
+			ticket->m_state = Ticket::State::ENDED;
+			ticket->m_context = nullptr;
+			ticket->m_task = nullptr;
+			return;
+
+		case Ticket::State::READY:
+			Remove(m_ready, ticket);
+			ticket->m_context = nullptr;
+			ticket->m_task = nullptr;
+			break;
+
+		case Ticket::State::ADMITTED:
+			break;
+
+		case Ticket::State::ENDED:
+			return;
+		}
+
+		ticket->m_state = Ticket::State::ENDED;
+
+		next = endSlot();
+		if (!next)
+		{
+			return;
+		}
+	}
+
+	run(std::move(next));
+}
+
+
+GatewayBulkhead::TicketPtr GatewayBulkhead::endSlot()
+{
+	// Called locked; hands the slot straight to the oldest waiting request.
+	if (m_waiting.empty())
+	{
+		m_inFlight--;
+		return nullptr;
+	}
+
+	TicketPtr ticket = m_waiting.front();
+	m_waiting.pop_front();
+
+	if (!admit(ticket))
+	{
+		return nullptr;
+	}
+	return ticket;
+}
+
+bool GatewayBulkhead::admit(TicketPtr &ticket)
+{
+	// Called locked; parks the request if all of its threads are busy.
+	if (m_maxThreads && (m_running >= m_maxThreads))
+	{
+		ticket->m_state = Ticket::State::READY;
+		m_ready.push_back(std::move(ticket));
+		return false;
+	}
+
+	ticket->m_state = Ticket::State::ADMITTED;
+	m_running++;
+	return true;
+}
+
+void GatewayBulkhead::run(TicketPtr &&ticket)
+{
+	GatewayBulkheadPtr self = this;
+
+	// Releasing an admitted ticket leaves its context and task alone, so
+	// they can be taken without the lock.
+	GatewayContextPtr context = ticket->m_context;
+	ticket->m_context = nullptr;
+
+	context->post(
+		[this, self, task = std::move(ticket->m_task)]() mutable
+		{
+			// The slot is given back even if the task throws.
+			struct RunGuard
+			{
+				GatewayBulkhead *m_bulkhead;
+				~RunGuard() { m_bulkhead->endRun(); }
+			} guard{ this };
+
+			task();
+		}
+	);
+}
+
+void GatewayBulkhead::endRun()
+{
+	TicketPtr ticket;
+
+	{
+		SyncLock lock(m_mutex);
+
+		if (m_ready.empty())
+		{
+			m_running--;
+			return;
+		}
+
+		ticket = m_ready.front();
+		m_ready.pop_front();
+		ticket->m_state = Ticket::State::ADMITTED;
+	}
+
+	run(std::move(ticket));
+}
+
+void GatewayBulkhead::expire(Ticket *ticket)
+{
+	GatewayContextPtr context;
+
+	{
+		SyncLock lock(m_mutex);
+
+		if (ticket->m_state != Ticket::State::WAITING)
+		{
+			return;
+		}
+
+		Remove(m_waiting, ticket);
+		ticket->m_state = Ticket::State::ENDED;
+		context = ticket->m_context;
+		ticket->m_context = nullptr;
+		ticket->m_task = nullptr;
+		m_timeoutCount++;
+	}
+
+	// Runs on the context's worker; the ticket has ended, so the response
+	// releases nothing.
+	context->sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "server busy");
+}
+
+
+void GatewayBulkhead::Remove(std::deque<TicketPtr> &queue, Ticket *ticket)
+{
+	auto it = std::find_if(
+		queue.begin(),
+		queue.end(),
+		[ticket](const TicketPtr &queued) { return static_cast<Ticket *>(queued) == ticket; });
+
+	if (it != queue.end())
+	{
+		queue.erase(it);
+	}
+}
+
+
+void GatewayBulkhead::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	SyncLock registryLock(sm_bulkheadMutex);
+
+	for (GatewayBulkhead *bulkhead : sm_bulkheads)
+	{
+		SyncLock lock(bulkhead->m_mutex);
+
+		const char *labels = bulkhead->m_labels;
+		writer.add("gateway_bulkhead_in_flight", bulkhead->m_inFlight, labels);
+		writer.add("gateway_bulkhead_in_flight_limit", bulkhead->m_maxInFlight, labels);
+		writer.add("gateway_bulkhead_queued", bulkhead->m_waiting.size(), labels);
+		writer.add("gateway_bulkhead_running", bulkhead->m_running, labels);
+		writer.add("gateway_bulkhead_shed", bulkhead->m_shedCount, labels);
+		writer.add("gateway_bulkhead_queue_timeouts", bulkhead->m_timeoutCount, labels);
+	}
+}
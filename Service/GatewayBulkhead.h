@@ -0,0 +1,87 @@
+#pragma once
+#include "GatewayExecutor.h"
+
+
+class GatewayContext;
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBulkhead
+//
+// Caps the requests a provider has in flight, the requests waiting for a
+// slot, and the executor threads its dispatches may occupy at once, so a
+// slow origin or a blocking auth check cannot starve other providers.
+// Requests beyond the queue, or queued for too long, are shed.
+//
+
+class GatewayBulkhead : public RefCounter
+{
+public:
+	using task_t = GatewayExecutor::task_t;
+
+	// A request's claim on the bulkhead, from dispatch until release.
+	class Ticket : public RefCounter
+	{
+		friend class GatewayBulkhead;
+
+	public:
+		virtual ~Ticket();
+
+	private:
+		enum class State { WAITING, READY, ADMITTED, ENDED };
+
+		RefPointer<GatewayContext> m_context;	// only while queued
+		task_t m_task;
+		State m_state{ State::WAITING };
+	};
+
+	using TicketPtr = RefPointer<Ticket>;
+
+	static const unsigned DEFAULT_QUEUE_TIMEOUT = 5000;
+
+	// Zero in-flight or thread limits mean unlimited; with no queue, requests
+	// are shed as soon as every in-flight slot is taken. The queue timeout is
+	// in milliseconds, zero waits indefinitely.
+	GatewayBulkhead(const String &labels, size_t maxInFlight, size_t maxQueued, size_t maxThreads, unsigned queueTimeout = DEFAULT_QUEUE_TIMEOUT);
+	virtual ~GatewayBulkhead();
+
+	// Runs the task once the request is admitted; false if it was shed. The
+	// ticket is set before the task can run.
+	bool dispatch(GatewayContext *context, task_t &&task, TicketPtr &ticket);
+
+	// Ends the request: frees its slot for the next queued one if it was
+	// admitted, or takes it off the queue if not.
+	void release(Ticket *ticket);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	String m_labels;
+
+	size_t m_maxInFlight;
+	size_t m_maxQueued;
+	size_t m_maxThreads;
+	unsigned m_queueTimeout;
+
+	SyncMutex m_mutex;
+	size_t m_inFlight{ 0 };
+	size_t m_running{ 0 };
+	std::deque<TicketPtr> m_waiting;	// waiting for an in-flight slot
+	std::deque<TicketPtr> m_ready;		// admitted, waiting for a thread
+	uint64_t m_shedCount{ 0 };
+	uint64_t m_timeoutCount{ 0 };
+
+	static SyncMutex sm_bulkheadMutex;
+	static std::set<GatewayBulkhead*> sm_bulkheads;
+
+	bool admit(TicketPtr &ticket);
+	void run(TicketPtr &&ticket);
+	void endRun();
+	void expire(Ticket *ticket);
+
+	TicketPtr endSlot();
+
+	static void Remove(std::deque<TicketPtr> &queue, Ticket *ticket);
+};
+
+using GatewayBulkheadPtr = RefPointer<GatewayBulkhead>;
@@ -0,0 +1,756 @@
+#include "pch.h"
+#include "GatewayConnectionPool.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayConnectionPool
+//
+
+SyncMutex GatewayConnectionPool::sm_poolMutex;
+std::set<GatewayConnectionPool*> GatewayConnectionPool::sm_pools;
+
+
+GatewayConnectionPool::GatewayConnectionPool(const String &labels, const Options &options) :
+	m_labels(labels),
+	m_options(options),
+	m_health(labels, options.m_health)
+{
+	SyncLock lock(sm_poolMutex);
+	sm_pools.insert(this);
+}
+
+GatewayConnectionPool::~GatewayConnectionPool()
+{
+	{
+		SyncLock lock(sm_poolMutex);
+		sm_pools.erase(this);
+	}
+
+	for (Connection &connection : m_idle)
+	{
+		connection.m_stream->close();
+	}
+
+	// Nothing comes back for the waiters any more.
+	for (Waiter &waiter : m_waiters)
+	{
+		GatewayExecutor::Push(
+			GatewayExecutor::ANY_WORKER,
+			[callback = std::move(waiter.m_waiter)]() mutable { callback(nullptr); });
+	}
+}
+
+
+bool GatewayConnectionPool::init(NetProtocol *protocol, const char *address)
+{
+	if (!NetConnectionPool::init(protocol, address))
+	{
+		return false;
+	}
+
+	m_initialized = true;
+	m_address = address;
+
+	if (m_options.m_minIdle || m_options.m_idleTimeout || m_options.m_maxLifetime
+		|| (m_options.m_health.m_probe != GatewayOriginHealth::Probe::NONE))
+	{
+		scheduleMaintenance(0);
+	}
+
+	return true;
+}
+
+void GatewayConnectionPool::stop()
+{
+	m_stopped = true;
+}
+
+
+NetStreamPtr GatewayConnectionPool::alloc(bool connect)
+{
+	if (!m_health.isAvailable())
+	{
+		return nullptr;
+	}
+
+	clock_t::time_point now = clock_t::now();
+	Completions completions;
+
+	NetStreamPtr stream;
+	bool connecting = false;
+	{
+		SyncLock lock(m_mutex);
+
+		// Waiting requests go first.
+		if (m_waiters.empty())
+		{
+			stream = takeIdle(now, completions);
+			if (!stream && connect && m_initialized && hasRoom())
+			{
+				m_connectingCount++;
+				connecting = true;
+			}
+		}
+	}
+
+	complete(completions);
+
+	return connecting ? open() : stream;
+}
+
+bool GatewayConnectionPool::alloc(NetStreamPtr &stream, waiter_t &&waiter)
+{
+	if (!m_options.m_maxConnections || !m_initialized)
+	{
+		stream = alloc();
+		return true;
+	}
+
+	if (!m_health.isAvailable())
+	{
+		stream = nullptr;
+		return true;
+	}
+
+	clock_t::time_point now = clock_t::now();
+	Completions completions;
+
+	bool connecting = false;
+	bool queued = false;
+	{
+		SyncLock lock(m_mutex);
+
+		if (m_waiters.empty())
+		{
+			stream = takeIdle(now, completions);
+			if (!stream && hasRoom())
+			{
+				m_connectingCount++;
+				connecting = true;
+			}
+		}
+
+		if (!stream && !connecting)
+		{
+			m_waiters.push_back({ std::move(waiter), now, now + std::chrono::milliseconds(m_options.m_queueTimeout) });
+			queued = true;
+		}
+	}
+
+	complete(completions);
+
+	// Waiters leave in order, so by then this one, or an earlier one, is due.
+	if (queued)
+	{
+		GatewayConnectionPoolPtr self = this;
+
+		GatewayExecutor::PushAfter(
+			GatewayExecutor::ANY_WORKER,
+			m_options.m_queueTimeout + 1,
+			[this, self]() mutable { expireWaiters(); });
+	}
+
+	if (connecting)
+	{
+		stream = open();
+	}
+
+	return !queued;
+}
+
+void GatewayConnectionPool::free(NetStream *stream, unsigned keepAliveTimeout)
+{
+	clock_t::time_point now = clock_t::now();
+	Completions completions;
+
+	{
+		SyncLock lock(m_mutex);
+
+		// Streams can also be handed in from outside, as subscribers attach.
+		Connection connection;
+		auto it = m_active.find(stream);
+		if (it != m_active.end())
+		{
+			connection = std::move(it->second);
+			m_active.erase(it);
+		}
+		else
+		{
+			connection.m_stream = stream;
+			connection.m_created = now;
+		}
+
+		connection.m_expires = getExpiry(connection, now, keepAliveTimeout);
+
+		if (isWornOut(connection, now) || (now >= connection.m_expires))
+		{
+			completions.m_closed.push_back(connection.m_stream);
+			m_retireCount++;
+			offerSlot(completions);
+		}
+		else
+		{
+			handOff(std::move(connection), now, false, completions);
+		}
+	}
+
+	complete(completions);
+}
+
+void GatewayConnectionPool::relay(NetStream *stream)
+{
+	SyncLock lock(m_mutex);
+
+	auto it = m_active.find(stream);
+	if ((it != m_active.end()) && !it->second.m_relayed)
+	{
+		it->second.m_relayed = true;
+		m_relayCount++;
+	}
+}
+
+void GatewayConnectionPool::discard(NetStream *stream, bool close)
+{
+	Completions completions;
+
+	{
+		SyncLock lock(m_mutex);
+
+		auto it = m_active.find(stream);
+		if (it != m_active.end())
+		{
+			if (it->second.m_relayed)
+			{
+				m_relayCount--;
+			}
+			else
+			{
+				m_discardCount++;
+			}
+
+			m_active.erase(it);
+			offerSlot(completions);
+		}
+	}
+
+	if (close)
+	{
+		stream->close();
+	}
+
+	complete(completions);
+}
+
+
+void GatewayConnectionPool::recordResponse(NetStream *stream, bool failed)
+{
+	uint64_t sample;
+	std::vector<uint64_t> window;
+	{
+		SyncLock lock(m_mutex);
+
+		auto it = m_active.find(stream);
+		if (it == m_active.end())
+		{
+			return;
+		}
+
+		sample = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - it->second.m_allocated).count());
+		uint64_t latency = m_latency;
+
+		// Kept at least 1 once known, so zero still means no samples.
+		latency = latency ? (latency - (latency / LATENCY_DECAY) + (sample / LATENCY_DECAY)) : sample;
+		m_latency = std::max<uint64_t>(latency, 1);
+
+		if (m_latencySamples.size() < LATENCY_WINDOW)
+		{
+			m_latencySamples.push_back(sample);
+		}
+		else
+		{
+			m_latencySamples[m_latencySampleCount % LATENCY_WINDOW] = sample;
+		}
+
+		if ((++m_latencySampleCount % TAIL_INTERVAL) == 0)
+		{
+			window = m_latencySamples;
+		}
+	}
+
+	if (!window.empty())
+	{
+		auto tail = window.begin() + ((window.size() * 95) / 100);
+		std::nth_element(window.begin(), tail, window.end());
+		m_tailLatency = std::max<uint64_t>(*tail, 1);
+	}
+
+	m_health.recordResponse(sample, failed);
+}
+
+size_t GatewayConnectionPool::getLoad()
+{
+	SyncLock lock(m_mutex);
+	return m_active.size() + m_waiters.size() + m_connectingCount;
+}
+
+
+unsigned GatewayConnectionPool::ParseKeepAliveTimeout(const char *header)
+{
+	// Keep-Alive: timeout=5, max=100
+	for (const char *cursor = header; cursor && *cursor; cursor++)
+	{
+		if ((_strnicmp(cursor, "timeout=", 8) == 0) && ((cursor == header) || (cursor[-1] == ' ') || (cursor[-1] == ',')))
+		{
+			return static_cast<unsigned>(StringToInt(cursor + 8));
+		}
+	}
+
+	return 0;
+}
+
+
+bool GatewayConnectionPool::hasRoom() const
+{
+	return !m_options.m_maxConnections
+		|| ((m_active.size() + m_idle.size() + m_connectingCount) < m_options.m_maxConnections);
+}
+
+NetStreamPtr GatewayConnectionPool::takeIdle(clock_t::time_point now, Completions &completions)
+{
+	while (!m_idle.empty())
+	{
+		Connection connection = std::move(m_idle.back());
+		m_idle.pop_back();
+
+		// The origin may have closed it already.
+		if (now >= connection.m_expires)
+		{
+			completions.m_closed.push_back(connection.m_stream);
+			m_expireCount++;
+			continue;
+		}
+
+		NetStreamPtr stream = connection.m_stream;
+		if (connection.m_requestCount++)
+		{
+			m_reuseCount++;
+		}
+		connection.m_allocated = now;
+		m_active.emplace(stream, std::move(connection));
+		return stream;
+	}
+
+	return nullptr;
+}
+
+void GatewayConnectionPool::handOff(Connection &&connection, clock_t::time_point now, bool warm, Completions &completions)
+{
+	if (!m_waiters.empty())
+	{
+		Waiter waiter = std::move(m_waiters.front());
+		m_waiters.pop_front();
+		m_waitTime.record(now - waiter.m_queued);
+
+		NetStreamPtr stream = connection.m_stream;
+		if (connection.m_requestCount++)
+		{
+			m_reuseCount++;
+		}
+		connection.m_allocated = now;
+		m_active.emplace(stream, std::move(connection));
+
+		completions.m_ready.emplace_back(std::move(waiter.m_waiter), stream);
+		return;
+	}
+
+	// Make room by closing the coldest connection.
+	if (m_options.m_maxIdle && (m_idle.size() >= m_options.m_maxIdle))
+	{
+		completions.m_closed.push_back(m_idle.front().m_stream);
+		m_idle.pop_front();
+		m_expireCount++;
+	}
+
+	// Warmed up connections go to the cold end.
+	if (warm)
+	{
+		m_idle.push_front(std::move(connection));
+	}
+	else
+	{
+		m_idle.push_back(std::move(connection));
+	}
+}
+
+void GatewayConnectionPool::offerSlot(Completions &completions)
+{
+	// A freed slot goes to the oldest waiter, which connects on a worker.
+	if (!m_waiters.empty() && hasRoom())
+	{
+		Waiter waiter = std::move(m_waiters.front());
+		m_waiters.pop_front();
+		m_waitTime.record(clock_t::now() - waiter.m_queued);
+
+		m_connectingCount++;
+		completions.m_connects.push_back(std::move(waiter.m_waiter));
+	}
+}
+
+
+NetStreamPtr GatewayConnectionPool::open(bool defer)
+{
+	NetStreamPtr stream = NetConnectionPool::alloc();
+
+	Completions completions;
+	{
+		SyncLock lock(m_mutex);
+
+		m_connectingCount--;
+
+		if (stream)
+		{
+			Connection connection;
+			connection.m_stream = stream;
+			connection.m_created = clock_t::now();
+			connection.m_allocated = connection.m_created;
+			connection.m_requestCount = 1;
+
+			m_active.emplace(stream, std::move(connection));
+			m_openCount++;
+		}
+		else
+		{
+			offerSlot(completions);
+		}
+	}
+
+	if (!stream)
+	{
+		m_health.recordFailure();
+	}
+
+	complete(completions, defer);
+
+	return stream;
+}
+
+void GatewayConnectionPool::complete(Completions &completions, bool defer)
+{
+	for (NetStream *stream : completions.m_closed)
+	{
+		stream->close();
+	}
+
+	// Maintenance leaves waiters to the executor, rather than keeping its
+	// round waiting on the requests they continue.
+	for (waiter_t &waiter : completions.m_connects)
+	{
+		if (defer)
+		{
+			completions.m_ready.emplace_back(std::move(waiter), open(true));
+		}
+		else
+		{
+			GatewayConnectionPoolPtr self = this;
+
+			GatewayExecutor::Push(
+				GatewayExecutor::ANY_WORKER,
+				[this, self, waiter = std::move(waiter)]() mutable { waiter(open()); });
+		}
+	}
+
+	for (auto &ready : completions.m_ready)
+	{
+		if (defer)
+		{
+			GatewayExecutor::Push(
+				GatewayExecutor::ANY_WORKER,
+				[waiter = std::move(ready.first), stream = ready.second]() mutable { waiter(stream); });
+		}
+		else
+		{
+			ready.first(ready.second);
+		}
+	}
+}
+
+
+GatewayConnectionPool::clock_t::time_point GatewayConnectionPool::getExpiry(const Connection &connection, clock_t::time_point now, unsigned keepAliveTimeout) const
+{
+	clock_t::time_point expires = clock_t::time_point::max();
+
+	if (m_options.m_idleTimeout)
+	{
+		expires = now + std::chrono::seconds(m_options.m_idleTimeout);
+	}
+
+	// A second short of the origin's timeout, so both clocks can be a little off.
+	if (keepAliveTimeout)
+	{
+		expires = std::min(expires, now + std::chrono::seconds(keepAliveTimeout - 1));
+	}
+
+	if (m_options.m_maxLifetime)
+	{
+		expires = std::min(expires, connection.m_created + std::chrono::seconds(m_options.m_maxLifetime));
+	}
+
+	return expires;
+}
+
+bool GatewayConnectionPool::isWornOut(const Connection &connection, clock_t::time_point now) const
+{
+	return (m_options.m_maxRequests && (connection.m_requestCount >= m_options.m_maxRequests))
+		|| (m_options.m_maxLifetime && ((now - connection.m_created) >= std::chrono::seconds(m_options.m_maxLifetime)));
+}
+
+
+void GatewayConnectionPool::probe()
+{
+	const GatewayOriginHealth::Options &options = m_health.getOptions();
+
+	NetStreamPtr stream = NetConnectionPool::alloc();
+	if (!stream || (options.m_probe != GatewayOriginHealth::Probe::HTTP))
+	{
+		if (stream)
+		{
+			stream->close();
+		}
+
+		m_health.recordProbe(stream != nullptr);
+		return;
+	}
+
+	// Answered asynchronously, so no thread waits on a slow origin.
+	m_probing = true;
+
+	ProbeExchangePtr exchange = new ProbeExchange;
+	exchange->m_stream = stream;
+	exchange->m_request.setMethod("GET");
+	exchange->m_request.setUri(options.m_probeUrl);
+	exchange->m_request.setVersion("HTTP/1.1");
+	exchange->m_request.setHost(m_address);
+	exchange->m_request.setHeader(HttpHeader::CONNECTION, "close");
+
+	GatewayConnectionPoolPtr self = this;
+
+	GatewayExecutor::PushAfter(
+		GatewayExecutor::ANY_WORKER,
+		options.m_probeTimeout,
+		[this, self, exchange]() mutable
+		{
+			endProbe(exchange, false);
+		}
+	);
+
+	exchange->m_request.send(
+		stream,
+		[this, self, exchange](IoState *state) mutable
+		{
+			if (state->failed())
+			{
+				state->setErrorCode(ERROR_SUCCESS);
+				endProbe(exchange, false);
+				return;
+			}
+
+			exchange->m_response.receive(
+				exchange->m_stream,
+				[this, self, exchange](IoState *state) mutable
+				{
+					// Only a success or a redirect means the origin is serving.
+					int statusCode = exchange->m_response.getStatusCode();
+					bool passed = state->succeeded() && (statusCode >= HttpStatus::OK) && (statusCode < HttpStatus::BAD_REQUEST);
+
+					state->setErrorCode(ERROR_SUCCESS);
+					endProbe(exchange, passed);
+				}
+			);
+		}
+	);
+}
+
+void GatewayConnectionPool::endProbe(ProbeExchange *exchange, bool passed)
+{
+	if (exchange->m_decided.exchange(true))
+	{
+		return;
+	}
+
+	// A timed out probe's i/o fails once closed, and is ignored above.
+	exchange->m_stream->close();
+
+	m_health.recordProbe(passed);
+	m_probing = false;
+}
+
+void GatewayConnectionPool::scheduleMaintenance(unsigned delay)
+{
+	GatewayConnectionPoolPtr self = this;
+
+	// Rounds never overlap, since each schedules the next once it is over.
+	GatewayExecutor::PushAfter(
+		GatewayExecutor::ANY_WORKER,
+		delay,
+		[this, self]() mutable
+		{
+			if (!m_stopped)
+			{
+				scheduleMaintenance(maintain());
+			}
+		}
+	);
+}
+
+unsigned GatewayConnectionPool::maintain()
+{
+	const GatewayOriginHealth::Options &healthOptions = m_health.getOptions();
+
+	clock_t::time_point now = clock_t::now();
+	Completions completions;
+	size_t idleCount;
+
+	{
+		SyncLock lock(m_mutex);
+
+		for (auto it = m_idle.begin(); it != m_idle.end(); )
+		{
+			if (now >= it->m_expires)
+			{
+				completions.m_closed.push_back(it->m_stream);
+				it = m_idle.erase(it);
+				m_expireCount++;
+				offerSlot(completions);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		idleCount = m_idle.size();
+	}
+
+	complete(completions, true);
+
+	// Connect outside the lock.
+	for (; idleCount < m_options.m_minIdle; idleCount++)
+	{
+		{
+			SyncLock lock(m_mutex);
+			if (!hasRoom())
+			{
+				break;
+			}
+			m_connectingCount++;
+		}
+
+		NetStreamPtr stream = NetConnectionPool::alloc();
+		Completions warmed;
+
+		{
+			SyncLock lock(m_mutex);
+
+			m_connectingCount--;
+
+			if (stream)
+			{
+				Connection connection;
+				connection.m_stream = stream;
+				connection.m_created = clock_t::now();
+				connection.m_expires = getExpiry(connection, connection.m_created, 0);
+
+				m_openCount++;
+				handOff(std::move(connection), clock_t::now(), true, warmed);
+			}
+			else
+			{
+				offerSlot(warmed);
+			}
+		}
+
+		complete(warmed, true);
+
+		if (!stream)
+		{
+			m_health.recordFailure();
+
+			if (!m_warmingFailed)
+			{
+				AfxLogWarning("Cannot warm up connection pool {%s}", m_labels);
+				m_warmingFailed = true;
+			}
+			break;
+		}
+
+		m_warmingFailed = false;
+	}
+
+	unsigned wait = MAINTAIN_INTERVAL;
+
+	if (healthOptions.m_probe != GatewayOriginHealth::Probe::NONE)
+	{
+		if (!m_probing && (clock_t::now() >= m_nextProbe))
+		{
+			probe();
+			m_nextProbe = clock_t::now() + std::chrono::seconds(std::max(healthOptions.m_probeInterval, 1u));
+		}
+
+		auto untilProbe = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextProbe - clock_t::now()).count() + 1;
+		wait = std::min<unsigned>(wait, static_cast<unsigned>(std::max<long long>(untilProbe, 0)));
+	}
+
+	return wait;
+}
+
+void GatewayConnectionPool::expireWaiters()
+{
+	clock_t::time_point now = clock_t::now();
+	Completions completions;
+
+	{
+		SyncLock lock(m_mutex);
+
+		while (!m_waiters.empty() && (now >= m_waiters.front().m_deadline))
+		{
+			Waiter &waiter = m_waiters.front();
+			m_waitTime.record(now - waiter.m_queued);
+			m_waitTimeoutCount++;
+
+			completions.m_ready.emplace_back(std::move(waiter.m_waiter), nullptr);
+			m_waiters.pop_front();
+		}
+	}
+
+	complete(completions);
+}
+
+
+void GatewayConnectionPool::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	SyncLock registryLock(sm_poolMutex);
+
+	for (GatewayConnectionPool *pool : sm_pools)
+	{
+		const char *labels = pool->m_labels;
+		writer.add("gateway_origin_pool_opened", pool->m_openCount, labels);
+		writer.add("gateway_origin_pool_reused", pool->m_reuseCount, labels);
+		writer.add("gateway_origin_pool_expired", pool->m_expireCount, labels);
+		writer.add("gateway_origin_pool_retired", pool->m_retireCount, labels);
+		writer.add("gateway_origin_pool_discarded", pool->m_discardCount, labels);
+		writer.add("gateway_origin_pool_wait_timeouts", pool->m_waitTimeoutCount, labels);
+		pool->m_waitTime.write(writer, "gateway_origin_pool_wait_microseconds", labels);
+		pool->m_health.writeMetrics(writer, labels);
+
+		if (pool->m_options.m_maxConnections)
+		{
+			writer.add("gateway_origin_pool_limit", pool->m_options.m_maxConnections, labels);
+		}
+
+		SyncLock lock(pool->m_mutex);
+		writer.add("gateway_origin_pool_active", pool->m_active.size(), labels);
+		writer.add("gateway_origin_pool_relayed", pool->m_relayCount, labels);
+		writer.add("gateway_origin_pool_idle", pool->m_idle.size(), labels);
+		writer.add("gateway_origin_pool_waiting", pool->m_waiters.size(), labels);
+	}
+}
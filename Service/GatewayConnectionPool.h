@@ -0,0 +1,213 @@
+#pragma once
+#include "GatewayExecutor.h"
+#include "GatewayOriginHealth.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayConnectionPool
+//
+// Connections to one origin. Idle connections are reused most recently used
+// first, so a few stay hot while the rest age out, and a connection that
+// has been idle, open or used for too long is closed instead of handed out.
+// With a connection limit, requests beyond it wait in FIFO order for a
+// connection to come back or a slot to free up. Maintenance rounds, run off
+// the executor's shared timer until the pool is stopped, close expired
+// connections ahead of time, keep a minimum of idle ones connected and probe
+// the origin's health; each waiter has a timer of its own. While the origin
+// is out of rotation, nothing is handed out.
+//
+
+class GatewayConnectionPool : public NetConnectionPool, public RefCounter
+{
+public:
+	struct Options
+	{
+		size_t m_minIdle{ 0 };
+		size_t m_maxIdle{ 0 };				// zero: unlimited
+		unsigned m_idleTimeout{ 0 };		// seconds; zero: unlimited
+		unsigned m_maxLifetime{ 0 };		// seconds; zero: unlimited
+		size_t m_maxRequests{ 0 };			// per connection; zero: unlimited
+		size_t m_maxConnections{ 0 };		// zero: unlimited
+		unsigned m_queueTimeout{ 0 };		// milliseconds
+
+		GatewayOriginHealth::Options m_health;
+	};
+
+	// Called with a connection, or with none if the wait timed out or the
+	// connection could not be made.
+	using waiter_t = std::function<void(NetStreamPtr stream)>;
+
+	GatewayConnectionPool(const String &labels, const Options &options);
+	virtual ~GatewayConnectionPool();
+
+	// Only an initialized pool makes connections of its own.
+	bool init(NetProtocol *protocol, const char *address);
+
+	// Ends maintenance, which holds a reference to the pool until its
+	// current round is over; nothing waits for that.
+	void stop();
+
+	// Without connect, only idle connections are handed out. Never waits, so
+	// at the connection limit the result may be null.
+	NetStreamPtr alloc(bool connect = true);
+
+	// Sets stream and returns true if the request need not wait; otherwise
+	// the waiter is queued. May connect, so must not be called inline.
+	bool alloc(NetStreamPtr &stream, waiter_t &&waiter);
+
+	// Takes back a connection that can carry another request. A Keep-Alive
+	// timeout sent by the origin bounds how long it is kept idle.
+	void free(NetStream *stream, unsigned keepAliveTimeout = 0);
+
+	// Keeps a connection taken over by a relay counted against the limit,
+	// until it is discarded when the relay ends.
+	void relay(NetStream *stream);
+
+	// Forgets a connection that failed, or whose relay ended.
+	void discard(NetStream *stream, bool close = true);
+
+	// Feeds the latency average and the origin's health with the time since
+	// the stream was handed out, once the origin has answered.
+	void recordResponse(NetStream *stream, bool failed = false);
+
+	// Requests holding, waiting for or making a connection.
+	size_t getLoad();
+
+	// Moving average of response times in microseconds; zero until known.
+	uint64_t getLatency() const;
+
+	// 95th percentile of recent response times in microseconds; zero until
+	// known.
+	uint64_t getTailLatency() const;
+
+	GatewayOriginHealth &getHealth();
+
+	// The timeout parameter of a Keep-Alive header, in seconds; zero if none.
+	static unsigned ParseKeepAliveTimeout(const char *header);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	using clock_t = std::chrono::steady_clock;
+
+	struct Connection
+	{
+		NetStreamPtr m_stream;
+		clock_t::time_point m_created;
+		clock_t::time_point m_expires;		// while idle
+		clock_t::time_point m_allocated;	// while active
+		size_t m_requestCount{ 0 };
+		bool m_relayed{ false };
+	};
+
+	struct Waiter
+	{
+		waiter_t m_waiter;
+		clock_t::time_point m_queued;
+		clock_t::time_point m_deadline;
+	};
+
+	// Work decided under the lock and carried out after it is released.
+	struct Completions
+	{
+		std::vector<std::pair<waiter_t, NetStreamPtr>> m_ready;
+		std::vector<waiter_t> m_connects;	// each holds a reserved slot
+		std::vector<NetStreamPtr> m_closed;
+	};
+
+	static const unsigned MAINTAIN_INTERVAL = 1000;		// milliseconds
+
+	// An HTTP probe under way; its answer or its timeout, whichever comes
+	// first, decides it.
+	struct ProbeExchange : public RefCounter
+	{
+		HttpRequest m_request;
+		HttpResponse m_response;
+		NetStreamPtr m_stream;
+		std::atomic<bool> m_decided{ false };
+	};
+
+	using ProbeExchangePtr = RefPointer<ProbeExchange>;
+
+	// Each response moves the average 1/LATENCY_DECAY of the way.
+	static const uint64_t LATENCY_DECAY = 8;
+
+	// The tail is taken over the last LATENCY_WINDOW responses, every
+	// TAIL_INTERVAL responses.
+	static const size_t LATENCY_WINDOW = 256;
+	static const size_t TAIL_INTERVAL = 32;
+
+	String m_labels;
+	Options m_options;
+	bool m_initialized{ false };
+	String m_address;
+	std::atomic<bool> m_stopped{ false };
+
+	SyncMutex m_mutex;
+	std::unordered_map<NetStream*, Connection> m_active;
+	std::deque<Connection> m_idle;			// most recently used last
+	std::deque<Waiter> m_waiters;
+	size_t m_connectingCount{ 0 };
+	size_t m_relayCount{ 0 };
+
+	std::atomic<uint64_t> m_openCount{ 0 };
+	std::atomic<uint64_t> m_reuseCount{ 0 };
+	std::atomic<uint64_t> m_expireCount{ 0 };
+	std::atomic<uint64_t> m_retireCount{ 0 };
+	std::atomic<uint64_t> m_discardCount{ 0 };
+	std::atomic<uint64_t> m_waitTimeoutCount{ 0 };
+	GatewayMetrics::Histogram m_waitTime;
+	std::atomic<uint64_t> m_latency{ 0 };
+	std::vector<uint64_t> m_latencySamples;		// ring of the last responses
+	size_t m_latencySampleCount{ 0 };
+	std::atomic<uint64_t> m_tailLatency{ 0 };
+
+	GatewayOriginHealth m_health;
+	clock_t::time_point m_nextProbe;
+	std::atomic<bool> m_probing{ false };
+	bool m_warmingFailed{ false };
+
+	static SyncMutex sm_poolMutex;
+	static std::set<GatewayConnectionPool*> sm_pools;
+
+	// Called locked.
+	bool hasRoom() const;
+	NetStreamPtr takeIdle(clock_t::time_point now, Completions &completions);
+	void handOff(Connection &&connection, clock_t::time_point now, bool warm, Completions &completions);
+	void offerSlot(Completions &completions);
+
+	NetStreamPtr open(bool defer = false);
+	void complete(Completions &completions, bool defer = false);
+
+	clock_t::time_point getExpiry(const Connection &connection, clock_t::time_point now, unsigned keepAliveTimeout) const;
+	bool isWornOut(const Connection &connection, clock_t::time_point now) const;
+
+	void probe();
+	void endProbe(ProbeExchange *exchange, bool passed);
+	void scheduleMaintenance(unsigned delay);
+	unsigned maintain();				// the delay until the next round
+	void expireWaiters();
+};
+
+using GatewayConnectionPoolPtr = RefPointer<GatewayConnectionPool>;
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline uint64_t GatewayConnectionPool::getLatency() const
+{
+	return m_latency;
+}
+
+inline uint64_t GatewayConnectionPool::getTailLatency() const
+{
+	return m_tailLatency;
+}
+
+inline GatewayOriginHealth &GatewayConnectionPool::getHealth()
+{
+	return m_health;
+}
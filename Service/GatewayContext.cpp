@@ -8,14 +8,25 @@
 // class GatewayContext
 //
 
+GatewayMetrics::Histogram GatewayContext::sm_inlineDispatchDelay;
+GatewayMetrics::Histogram GatewayContext::sm_queuedDispatchDelay;
+
+
 GatewayContext::GatewayContext(GatewayDispatcher *dispatcher) :
 	m_dispatcher(dispatcher)
 {
 	assert(m_dispatcher);
+
+	GatewayStreamSettings &streamSettings = theApp.getStreamSettings();
+	if (streamSettings.StreamRequests)
+	{
+		m_requestPump = new GatewayStreamPump(streamSettings.BufferSize);
+	}
 }
 
 GatewayContext::~GatewayContext()
 {
+	releaseBulkhead();
 }
 
 
@@ -23,44 +34,30 @@ void GatewayContext::beginContext(NetStream *stream)
 {
 	__super::beginContext(stream);
 
+	m_worker = GatewayExecutor::GetLocalWorker();
+
 	beginRequest();
 }
 
 void GatewayContext::beginRequest()
 {
+	releaseBulkhead();
+
 	reset();
 
+	if (m_requestPump)
+	{
+		receiveRequestHead();
+		return;
+	}
+
 	receiveRequest(
 		getStream(),
 		[this](IoState *state) mutable
 		{
 			if (state->succeeded())
 			{
-				AfxPushIoProcess(
-					[this]() mutable
-					{
- 						String hostName = request.getHost();
-
-						GatewayHostPtr host = m_dispatcher->lookupHost(hostName);
-						if (host)
-						{
-							HttpUri uri = Http::DecodeUri(request.getUri());
-							GatewayProviderPtr provider = host->lookupProvider(uri);
-							if (provider)
-							{
-								provider->beginDispatch(this, uri);
-							}
-							else
-							{
-								sendErrorResponse(HttpStatus::NOT_FOUND);
-							}
-						}
-						else
-						{
-							sendErrorResponse(HttpStatus::BAD_REQUEST);
-						}
-					}
-				);
+				routeRequest();
 			}
 			else
 			{
@@ -70,6 +67,264 @@ void GatewayContext::beginRequest()
 	);
 }
 
+void GatewayContext::receiveRequestHead()
+{
+	m_requestPump->readHead(
+		getStream(),
+		[this](bool succeeded) mutable
+		{
+			if (!succeeded)
+			{
+				discard();
+				return;
+			}
+
+			GatewayMessageHead &head = m_requestPump->getHead();
+
+			// The body stays on the socket until a provider forwards it.
+			m_requestFramer = GatewayBodyFramer::ForRequest(head);
+			m_requestBodyPending = !m_requestFramer.isComplete();
+			m_requestBodyClaimed = false;
+
+			// Transfer-Encoding overrides Content-Length, which must not reach
+			// the origin, or it may frame the body differently.
+			if (head.hasHeader(HttpHeader::TRANSFER_ENCODING))
+			{
+				head.removeHeader(HttpHeader::CONTENT_LENGTH);
+			}
+
+			// Mirror the head into the request so routing works unchanged.
+			request.setMethod(head.getMethod());
+			request.setUri(head.getUri());
+			request.setVersion(head.getVersion());
+
+			for (auto &header : head.getHeaders())
+			{
+				request.addHeader(header.first, header.second);
+			}
+
+			if (m_requestFramer.isValid())
+			{
+				routeRequest();
+			}
+			else
+			{
+				sendErrorResponse(HttpStatus::BAD_REQUEST);
+			}
+		}
+	);
+}
+
+static inline void __TrimHostPort(const char *hostName, size_t &length)
+{
+	// Keep IPv6 literals intact: "[::1]:8080" -> "[::1]".
+	for (size_t pos = length; pos > 0; --pos)
+	{
+		char c = hostName[pos - 1];
+		if (c == ':')
+		{
+			length = pos - 1;
+			break;
+		}
+		if ((c < '0') || (c > '9'))
+		{
+			break;
+		}
+	}
+}
+
+void GatewayContext::routeRequest()
+{
+	// Routing never blocks, so it runs on the completion thread; only the
+	// dispatch itself is queued, unless the provider can run inline.
+	auto routeTime = std::chrono::steady_clock::now();
+
+	// Look the host up in place; a streamed head already holds the value.
+	String hostValue;
+	const String *hostHeader = m_requestPump ? m_requestPump->getHead().findHeader(HttpHeader::HOST) : nullptr;
+	if (!hostHeader)
+	{
+		hostValue = request.getHost();
+		hostHeader = &hostValue;
+	}
+
+	const char *hostName = *hostHeader;
+	size_t hostLength = hostHeader->getLength();
+	__TrimHostPort(hostName, hostLength);
+
+	GatewayHostPtr host = m_dispatcher->lookupHost(hostName, hostLength);
+	if (!host)
+	{
+		sendErrorResponse(HttpStatus::BAD_REQUEST);
+		return;
+	}
+
+	HttpUri uri = Http::DecodeUri(request.getUri());
+	m_routePath = uri.getPath();
+
+	GatewayProviderPtr provider = host->lookupProvider(m_routePath, m_routePath.getLength(), &m_mountLength);
+	if (!provider)
+	{
+		sendErrorResponse(HttpStatus::NOT_FOUND);
+		return;
+	}
+
+	m_inlineDispatch = provider->canDispatchInline();
+	if (m_inlineDispatch)
+	{
+		sm_inlineDispatchDelay.record(std::chrono::steady_clock::now() - routeTime);
+
+		beginDispatch(provider, uri);
+	}
+	else
+	{
+		GatewayExecutor::task_t dispatch =
+			[this, provider, uri, routeTime]() mutable
+			{
+				sm_queuedDispatchDelay.record(std::chrono::steady_clock::now() - routeTime);
+
+				beginDispatch(provider, uri);
+			};
+
+		GatewayBulkhead *bulkhead = provider->getBulkhead();
+		if (!bulkhead)
+		{
+			post(std::move(dispatch));
+			return;
+		}
+
+		// Held until the next request or the end of the connection. Set first,
+		// since the dispatch may finish the request before returning.
+		m_bulkhead = bulkhead;
+
+		if (!bulkhead->dispatch(this, std::move(dispatch), m_bulkheadTicket))
+		{
+			m_bulkhead = nullptr;
+			sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "server busy");
+		}
+	}
+}
+
+void GatewayContext::beginDispatch(GatewayProvider *provider, const HttpUri &uri)
+{
+	try
+	{
+		provider->beginDispatch(this, uri);
+	}
+	catch (HttpException &x)
+	{
+		// Thrown on purpose, for requests the provider turns down.
+		sendErrorResponse(x.getStatusCode());
+	}
+	catch (Exception &x)
+	{
+		AfxLogError("Error dispatching request - %s", x.getMessage());
+		sendErrorResponse(HttpStatus::SERVER_ERROR);
+	}
+}
+
+
+void GatewayContext::releaseBulkhead()
+{
+	GatewayBulkheadPtr bulkhead = m_bulkhead;
+	GatewayBulkhead::TicketPtr ticket = m_bulkheadTicket;
+	if (bulkhead)
+	{
+		m_bulkhead = nullptr;
+		m_bulkheadTicket = nullptr;
+		bulkhead->release(ticket);
+	}
+}
+
+
+void GatewayContext::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	sm_inlineDispatchDelay.write(writer, "gateway_dispatch_delay_microseconds", "mode=\"inline\"");
+	sm_queuedDispatchDelay.write(writer, "gateway_dispatch_delay_microseconds", "mode=\"queued\"");
+}
+
+
+const String &GatewayContext::getForwardedPeers()
+{
+	if (m_forwardedPeers.isEmpty())
+	{
+		String fwdFor = getStream()->getRemoteAddress();
+		String fwdBy = getStream()->getLocalAddress();
+
+		fwdFor.splitLeft(":", &fwdFor, nullptr);	// truncate port
+		fwdBy.splitLeft(":", &fwdBy, nullptr);		// truncate port
+
+		m_forwardedPeers.format("for=%s;by=%s", fwdFor, fwdBy);
+	}
+
+	return m_forwardedPeers;
+}
+
+
+bool GatewayContext::isExpectingContinue() const
+{
+	static const String CONTINUE_EXPECTATION = "100-continue";
+	static const String HTTP_VERSION_1_0 = "HTTP/1.0";
+
+	if (!m_requestPump || !m_requestBodyPending)
+	{
+		return false;
+	}
+
+	const GatewayMessageHead &head = m_requestPump->getHead();
+	return head.hasToken(HttpHeader::EXPECT, CONTINUE_EXPECTATION) && (head.getVersion().compareNoCase(HTTP_VERSION_1_0) != 0);
+}
+
+bool GatewayContext::acceptsInterimResponses() const
+{
+	static const String HTTP_VERSION_1_0 = "HTTP/1.0";
+
+	// Only a head read by the gateway tells the version; without one, the
+	// request body was read in full, so nothing waits for a 100 either.
+	return m_requestPump && (m_requestPump->getHead().getVersion().compareNoCase(HTTP_VERSION_1_0) != 0);
+}
+
+bool GatewayContext::isClientKeepAlive() const
+{
+	static const String CLOSE_CONNECTION = "close";
+
+	if (m_requestPump)
+	{
+		return m_requestPump->getHead().isKeepAlive();
+	}
+
+	// As syncConnectionType decides for the gateway's own responses.
+	String type = request.getHeader(HttpHeader::CONNECTION);
+	if (type.isEmpty())
+	{
+		type = HttpConfig.DefaultConnectionType;
+	}
+	return type.compareNoCase(CLOSE_CONNECTION) != 0;
+}
+
+void GatewayContext::sendRequestHead(NetStream *stream, GatewayStreamPump::handler_t &&handler)
+{
+	m_requestPump->writeHead(stream, std::move(handler));
+}
+
+void GatewayContext::sendRequestBody(NetStream *stream, GatewayStreamPump::handler_t &&handler)
+{
+	m_requestPump->pumpBody(
+		getStream(),
+		stream,
+		m_requestFramer,
+		[this, handler](bool succeeded) mutable
+		{
+			if (succeeded)
+			{
+				m_requestBodyPending = false;
+			}
+
+			handler(succeeded);
+		}
+	);
+}
+
 
 void GatewayContext::receiveResponse(HttpResponsePtr response, NetStream *stream, io_handler_t &&handler)
 {
@@ -95,6 +350,28 @@ void GatewayContext::receiveResponse(HttpResponsePtr response, NetStream *stream
 	);
 }
 
+void GatewayContext::receiveHedgeResponse(HttpResponsePtr response, NetStream *stream, io_handler_t &&handler)
+{
+	m_mutex.lock();
+	m_hedgeStreams.push_back(stream);
+	m_mutex.unlock();
+
+	response->receive(
+		stream,
+		[response, handler](IoState *state) mutable
+		{
+			handler(state);
+		}
+	);
+}
+
+void GatewayContext::endHedgeResponses()
+{
+	m_mutex.lock();
+	m_hedgeStreams.clear();
+	m_mutex.unlock();
+}
+
 
 void GatewayContext::sendResponse(HttpResponsePtr response, io_handler_t &&handler)
 {
@@ -109,7 +386,8 @@ void GatewayContext::sendResponse(HttpResponsePtr response, io_handler_t &&handl
 
 			if (!isRelay())
 			{
-				if (state->succeeded() && response->isKeepAlive())
+				// An unread request body leaves the connection out of sync.
+				if (state->succeeded() && response->isKeepAlive() && isClientKeepAlive() && !m_requestBodyPending)
 				{
 					beginRequest();
 				}
@@ -125,82 +403,41 @@ void GatewayContext::sendResponse(HttpResponsePtr response, io_handler_t &&handl
 
 void GatewayContext::sendErrorResponse(int statusCode, const char *statusMeaning)
 {
-	HttpResponsePtr response = new HttpServerResponse;
+	HttpResponsePtr response = new GatewayServerResponse;
 	response->setStatus(statusCode, statusMeaning);
 	sendResponse(response);
 }
 
 
-void GatewayContext::beginRelay(NetStream *serverStream)
-{
-	// Hold on to the server stream.
-	m_serverStream = serverStream;
-
-	// Initialize relay buffers.
-	m_clientRelayBuffer.alloc(RELAY_BUFFER_SIZE);
-	m_serverRelayBuffer.alloc(RELAY_BUFFER_SIZE);
-
-	// Start relaying from both ends.
-	beginServerRelay();
-	beginClientRelay();
-}
-
-void GatewayContext::beginClientRelay()
+void GatewayContext::sendRawResponse(const String &head, const String &body, bool keepAlive)
 {
-	m_stream->read(
-		m_clientRelayBuffer, m_clientRelayBuffer.getCapacity(),
-		[this](IoState *state) mutable
+	getStream()->write(
+		static_cast<const char *>(head), head.getLength(),
+		[this, head, body, keepAlive](IoState *state) mutable
 		{
-			size_t count = state->getTransferCount();
-			if (count)
+			if (!state->succeeded() || body.isEmpty())
 			{
-				SyncSharedLock lock(m_relayMutex);
-				if (m_serverStream)
-				{
-					m_serverStream->write(
-						m_clientRelayBuffer, count,
-						[this](IoState *state) mutable
-						{
-							if (state->succeeded())
-							{
-								beginClientRelay();
-							}
-							else
-							{
-								SyncLock lock(m_relayMutex);
-								closeClientRelay();
-							}
-						}
-					);
-				}
-				else
-				{
-					lock.unlock();
+				endResponse(state->succeeded(), keepAlive);
+				return;
+			}
 
-					SyncLock lock(m_relayMutex);
-					closeClientRelay();
+			getStream()->write(
+				static_cast<const char *>(body), body.getLength(),
+				[this, body, keepAlive](IoState *state) mutable
+				{
+					endResponse(state->succeeded(), keepAlive);
 				}
-			}
-			else
-			{
-				SyncLock lock(m_relayMutex);
-				closeClientRelay();
-			}
+			);
 		}
 	);
 }
-void GatewayContext::closeClientRelay()
-{
-	if (m_stream)
-	{
-		m_clientRelayBuffer.free();
-		m_stream->close();
-		m_stream = nullptr;
-	}
 
-	if (m_serverStream)
+void GatewayContext::endResponse(bool succeeded, bool keepAlive)
+{
+	// An unread request body leaves the connection out of sync.
+	if (succeeded && keepAlive && !m_requestBodyPending)
 	{
-		m_serverStream->close();
+		beginRequest();
 	}
 	else
 	{
@@ -208,90 +445,255 @@ void GatewayContext::closeClientRelay()
 	}
 }
 
-void GatewayContext::beginServerRelay()
+
+void GatewayContext::streamResponse(GatewayStreamPump *pump, NetStream *serverStream, stream_handler_t &&handler)
 {
-	SyncSharedLock lock(m_relayMutex);
+	GatewayStreamPumpPtr streamPump = pump;
+	NetStreamPtr sourceStream = serverStream;
 
-	m_serverStream->read(
-		m_serverRelayBuffer, m_serverRelayBuffer.getCapacity(),
-		[this](IoState *state) mutable
+	m_mutex.lock();
+	m_serverStream = serverStream;
+	m_mutex.unlock();
+
+	streamPump->readHead(
+		sourceStream,
+		[this, streamPump, sourceStream, handler](bool succeeded) mutable
 		{
-			size_t count = state->getTransferCount();
-			if (count)
+			if (!succeeded)
+			{
+				endStreamResponse(streamPump, false, handler);
+				return;
+			}
+
+			// Relay the head as soon as it is parsed.
+			const GatewayMessageHead &head = streamPump->getHead();
+			bool isInterim = head.isInterim();
+			bool isContinue = head.getStatusCode() == HttpStatus::CONTINUE;
+			bool isSwitch = head.getStatusCode() == HttpStatus::SWITCH_PROTOCOLS;
+			GatewayBodyFramer framer = GatewayBodyFramer::ForResponse(head, request.getMethod());
+
+			// A final answer ahead of 100 means the body is not wanted.
+			if (!isInterim && isExpectingContinue())
+			{
+				claimRequestBody(sourceStream);
+			}
+
+			// Only a requested upgrade may take the connection over.
+			if (isSwitch && !request.hasHeader(HttpHeader::UPGRADE))
 			{
-				SyncSharedLock lock(m_relayMutex);
-				if (m_stream)
+				endStreamResponse(streamPump, false, handler);
+				return;
+			}
+
+			if (isInterim && !acceptsInterimResponses())
+			{
+				streamResponse(streamPump, sourceStream, std::move(handler));
+				return;
+			}
+
+			streamPump->writeHead(
+				getStream(),
+				[this, streamPump, sourceStream, handler, isInterim, isContinue, isSwitch, framer](bool succeeded) mutable
 				{
-					m_stream->write(
-						m_serverRelayBuffer, count,
-						[this](IoState *state) mutable
-						{
-							if (state->succeeded())
+					if (!succeeded)
+					{
+						endStreamResponse(streamPump, false, handler);
+					}
+					else if (isInterim && isContinue && isExpectingContinue() && claimRequestBody(sourceStream))
+					{
+						// The origin accepted the expectation; now forward the body.
+						sendRequestBody(
+							sourceStream,
+							[this, streamPump, sourceStream, handler](bool succeeded) mutable
+							{
+								if (succeeded)
+								{
+									streamResponse(streamPump, sourceStream, std::move(handler));
+								}
+								else
+								{
+									endStreamResponse(streamPump, false, handler);
+								}
+							}
+						);
+					}
+					else if (isInterim)
+					{
+						// 1xx responses precede the final one.
+						streamResponse(streamPump, sourceStream, std::move(handler));
+					}
+					else if (isSwitch)
+					{
+						// Don't lose upgraded protocol data that arrived with the head.
+						streamPump->writePending(
+							getStream(),
+							[this, streamPump, handler](bool succeeded) mutable
 							{
-								beginServerRelay();
+								endStreamResponse(streamPump, succeeded, handler);
 							}
-							else
+						);
+					}
+					else
+					{
+						streamPump->pumpBody(
+							sourceStream,
+							getStream(),
+							framer,
+							[this, streamPump, handler](bool succeeded) mutable
 							{
-								SyncLock lock(m_relayMutex);
-								closeServerRelay();
+								endStreamResponse(streamPump, succeeded, handler);
 							}
-						}
-					);
+						);
+					}
 				}
-				else
-				{
-					lock.unlock();
+			);
+		}
+	);
+}
 
-					SyncLock lock(m_relayMutex);
-					closeServerRelay();
-				}
-			}
-			else
+void GatewayContext::expectContinue(NetStream *serverStream)
+{
+	GatewayContextPtr self = this;
+	NetStreamPtr sinkStream = serverStream;
+
+	postAfter(
+		EXPECT_CONTINUE_TIMEOUT,
+		[this, self, sinkStream]() mutable
+		{
+			if (!claimRequestBody(sinkStream))
 			{
-				SyncLock lock(m_relayMutex);
-				closeServerRelay();
+				return;
 			}
+
+			// The response is being read meanwhile; closing fails it as well.
+			sendRequestBody(
+				sinkStream,
+				[sinkStream](bool succeeded) mutable
+				{
+					if (!succeeded)
+					{
+						sinkStream->close();
+					}
+				}
+			);
 		}
 	);
 }
-void GatewayContext::closeServerRelay()
+
+bool GatewayContext::claimRequestBody(NetStream *serverStream)
 {
-	if (m_serverStream)
-	{
-		m_serverRelayBuffer.free();
-		m_serverStream->close();
-		m_serverStream = nullptr;
-	}
+	// Only for the origin exchange under way, so a retry or the next request
+	// is left alone.
+	m_mutex.lock();
+	bool claimed = !m_requestBodyClaimed && (m_serverStream == serverStream);
+	m_requestBodyClaimed |= claimed;
+	m_mutex.unlock();
+
+	return claimed;
+}
+
+void GatewayContext::endStreamResponse(GatewayStreamPump *pump, bool succeeded, stream_handler_t &handler)
+{
+	m_mutex.lock();
+	m_serverStream = nullptr;
+	m_mutex.unlock();
+
+	handler(pump, succeeded);
 
-	if (m_stream)
+	// Until the head is relayed, the handler is free to send its own response.
+	if (pump->isHeadSent() && !isRelay())
 	{
-		m_stream->close();
+		if (succeeded && pump->isKeepAlive() && isClientKeepAlive() && !m_requestBodyPending)
+		{
+			beginRequest();
+		}
+		else
+		{
+			discard();
+		}
 	}
-	else
+}
+
+
+void GatewayContext::beginRelay(NetStream *serverStream, size_t bufferSize, GatewayRelay::handler_t &&handler)
+{
+	// Hold on to the server stream.
+	m_mutex.lock();
+	m_serverStream = serverStream;
+	m_mutex.unlock();
+
+	m_relay.attach(m_stream, serverStream);
+
+	// Client data read along with the upgrade request belongs to the server.
+	if (m_requestPump && m_requestPump->hasPendingData())
 	{
-		discard();
+		m_requestPump->writePending(
+			serverStream,
+			[this, bufferSize, handler](bool succeeded) mutable
+			{
+				startRelay(bufferSize, std::move(handler));
+			}
+		);
+		return;
 	}
+
+	startRelay(bufferSize, std::move(handler));
+}
+
+void GatewayContext::startRelay(size_t bufferSize, GatewayRelay::handler_t &&handler)
+{
+	// Start relaying from both ends.
+	m_relay.begin(
+		bufferSize ? bufferSize : RELAY_BUFFER_SIZE,
+		[this, handler]() mutable
+		{
+			m_mutex.lock();
+			m_serverStream = nullptr;
+			m_mutex.unlock();
+
+			if (handler)
+			{
+				handler();
+			}
+
+			discard();
+		}
+	);
 }
 
 
 bool GatewayContext::close()
 {
-	SyncLock lock(m_relayMutex);
-
-	if (m_serverStream)
+	if (m_relay.isActive())
 	{
-		closeServerRelay();
+		m_relay.close();
 		return true;
 	}
-	else
+
+	// Fail any pending origin i/o; its completion ends the context.
+	m_mutex.lock();
+	NetStreamPtr serverStream = m_serverStream;
+	std::vector<NetStreamPtr> hedgeStreams = m_hedgeStreams;
+	m_mutex.unlock();
+
+	if (serverStream)
 	{
-		return NetContext::close();
+		serverStream->close();
 	}
+
+	for (NetStreamPtr &hedgeStream : hedgeStreams)
+	{
+		hedgeStream->close();
+	}
+
+	return NetContext::close();
 }
 
 
 void GatewayContext::discard()
 {
+	releaseBulkhead();
+
 	m_dispatcher->endContext(this);
 }
 
@@ -1,5 +1,9 @@
 #pragma once
+#include "GatewayStream.h"
+#include "GatewayRelay.h"
+#include "GatewayObjectPool.h"
 #include "GatewayHost.h"
+#include "GatewayExecutor.h"
 
 
 class GatewayDispatcher;
@@ -8,12 +12,17 @@ class GatewayDispatcher;
 //////////////////////////////////////////////////////////////////////////
 // class GatewayContext
 //
+// Contexts and the responses built for them are allocated from per-thread
+// object pools, since short-lived connections churn through them quickly.
+//
 
-class GatewayContext : public NetContext
+class GatewayContext : public NetContext, public GatewayPooledObject<GatewayContext>
 {
 public:
 	HttpRequest request;
 
+	using stream_handler_t = std::function<void(GatewayStreamPump *pump, bool succeeded)>;
+
 	GatewayContext(GatewayDispatcher *dispatcher);
 	virtual ~GatewayContext();
 
@@ -24,38 +33,119 @@ public:
 	void receiveRequest(NetStream *stream, io_handler_t &&handler);
 	void sendRequest(NetStream *stream, io_handler_t &&handler);
 
+	// Set while a provider runs on the I/O completion thread.
+	bool isDispatchingInline() const;
+
+	// Queues work on the executor worker of the core that accepted the connection.
+	void post(GatewayExecutor::task_t &&task);
+	void postAfter(unsigned delay, GatewayExecutor::task_t &&task);	// milliseconds
+
+	// Request path below the matched provider mount.
+	String getPathInfo() const;
+
+	// "for=...;by=..." for the Forwarded header; fixed per connection.
+	const String &getForwardedPeers();
+
+	bool isStreamingRequest() const;
+	bool isRequestBodyPending() const;
+	// A head read by the gateway, with no body and nothing read past it, so
+	// getRequestHead() is the whole request.
+	bool isRequestBuffered() const;
+	bool isExpectingContinue() const;
+	GatewayMessageHead &getRequestHead();
+	void sendRequestHead(NetStream *stream, GatewayStreamPump::handler_t &&handler);
+	void sendRequestBody(NetStream *stream, GatewayStreamPump::handler_t &&handler);
+
 	void receiveResponse(HttpResponsePtr response, NetStream *stream, io_handler_t &&handler);
+
+	// Responses raced against each other; closing the context fails them as
+	// well, but their completions leave the context alone, so it can move on
+	// with the winner while the loser is still being closed.
+	void receiveHedgeResponse(HttpResponsePtr response, NetStream *stream, io_handler_t &&handler);
+	void endHedgeResponses();
 	void sendResponse(HttpResponsePtr response, io_handler_t &&handler = nullptr);
 	void sendErrorResponse(int statusCode, const char *statusMeaning = nullptr);
 
+	// Writes a serialized head, then the body if any, as it is; a cached body
+	// goes out without being copied into the head.
+	void sendRawResponse(const String &head, const String &body, bool keepAlive);
+
+	// Continues with the next request, or ends the connection.
+	void endResponse(bool succeeded, bool keepAlive);
+
+	void streamResponse(GatewayStreamPump *pump, NetStream *serverStream, stream_handler_t &&handler);
+
+	// With "Expect: 100-continue" the body goes out on the origin's 100, or
+	// after this long without an answer, since origins may ignore it. A final
+	// answer first leaves it unsent, and neither connection is kept.
+	static const unsigned EXPECT_CONTINUE_TIMEOUT = 1000;	// milliseconds
+	void expectContinue(NetStream *serverStream);
+
+	static const size_t RELAY_BUFFER_SIZE = 8192;
+
 	bool isRelay();
-	void beginRelay(NetStream *serverStream);
+	// The handler runs once the relay has ended.
+	void beginRelay(NetStream *serverStream, size_t bufferSize = RELAY_BUFFER_SIZE, GatewayRelay::handler_t &&handler = nullptr);
 
 	void reset();
 	void discard();
 
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
 protected:
 	SyncMutex m_mutex;
 	NetStreamPtr m_serverStream;
+	std::vector<NetStreamPtr> m_hedgeStreams;
 	GatewayDispatcher *m_dispatcher;
 
 private:
-	static const unsigned RELAY_BUFFER_SIZE = 8192;
+	GatewayStreamPumpPtr m_requestPump;
+	GatewayBodyFramer m_requestFramer;
+	bool m_requestBodyPending{ false };
+	bool m_requestBodyClaimed{ false };		// forwarded or declined once
+
+	GatewayRelay m_relay;
+
+	String m_routePath;
+	size_t m_mountLength{ 0 };
+	bool m_inlineDispatch{ false };
+	unsigned m_worker{ GatewayExecutor::ANY_WORKER };
+	GatewayBulkheadPtr m_bulkhead;
+	GatewayBulkhead::TicketPtr m_bulkheadTicket;
+
+	static GatewayMetrics::Histogram sm_inlineDispatchDelay;
+	static GatewayMetrics::Histogram sm_queuedDispatchDelay;
+
+	String m_forwardedPeers;
+
+	void receiveRequestHead();
+	void routeRequest();
+	// Inline or queued alike, a provider's error ends up as a response.
+	void beginDispatch(GatewayProvider *provider, const HttpUri &uri);
+	void releaseBulkhead();
 
-	SyncMutex m_relayMutex;
+	// HTTP/1.0 clients get no 1xx responses.
+	bool acceptsInterimResponses() const;
+	bool isClientKeepAlive() const;
 
-	MemBuffer m_clientRelayBuffer;
-	MemBuffer m_serverRelayBuffer;
+	void endStreamResponse(GatewayStreamPump *pump, bool succeeded, stream_handler_t &handler);
+	bool claimRequestBody(NetStream *serverStream);
 
-	void beginClientRelay();
-	void closeClientRelay();
-	void beginServerRelay();
-	void closeServerRelay();
+	void startRelay(size_t bufferSize, GatewayRelay::handler_t &&handler);
 };
 
 using GatewayContextPtr = RefPointer<GatewayContext>;
 
 
+class GatewayResponse : public HttpResponse, public GatewayPooledObject<GatewayResponse>
+{
+};
+
+class GatewayServerResponse : public HttpServerResponse, public GatewayPooledObject<GatewayServerResponse>
+{
+};
+
+
 /* Inline Implementations */
 
 inline void GatewayContext::receiveRequest(NetStream *stream, io_handler_t &&handler)
@@ -68,20 +158,57 @@ inline void GatewayContext::sendRequest(NetStream *stream, io_handler_t &&handle
 	request.send(stream, std::move(handler));
 }
 
+inline bool GatewayContext::isDispatchingInline() const
+{
+	return m_inlineDispatch;
+}
+
+inline void GatewayContext::post(GatewayExecutor::task_t &&task)
+{
+	GatewayExecutor::Push(m_worker, std::move(task));
+}
+
+inline void GatewayContext::postAfter(unsigned delay, GatewayExecutor::task_t &&task)
+{
+	GatewayExecutor::PushAfter(m_worker, delay, std::move(task));
+}
+
+inline String GatewayContext::getPathInfo() const
+{
+	return m_routePath.mid(m_mountLength);
+}
+
+inline bool GatewayContext::isStreamingRequest() const
+{
+	return m_requestPump != nullptr;
+}
+
+inline bool GatewayContext::isRequestBodyPending() const
+{
+	return m_requestBodyPending;
+}
+
+inline bool GatewayContext::isRequestBuffered() const
+{
+	return m_requestPump && m_requestFramer.isComplete() && !m_requestPump->hasPendingData();
+}
+
+inline GatewayMessageHead &GatewayContext::getRequestHead()
+{
+	return m_requestPump->getHead();
+}
+
 inline void GatewayContext::reset()
 {
 	request.reset();
 
 	if (isRelay())
 	{
-		m_clientRelayBuffer.free();
-		m_serverRelayBuffer.free();
-		m_serverStream->close();
-		m_serverStream = nullptr;
+		m_relay.reset();
 	}
 }
 
 inline bool GatewayContext::isRelay()
 {
-	return m_clientRelayBuffer.getCapacity();
+	return m_relay.isStarted();
 }
\ No newline at end of file
@@ -6,6 +6,11 @@
 // class GatewayDispatcher
 //
 
+SyncMutex GatewayDispatcher::sm_hazardMutex;
+std::set<GatewayDispatcher::HazardSlot*> GatewayDispatcher::sm_hazardSlots;
+thread_local GatewayDispatcher::HazardSlot GatewayDispatcher::st_hazardSlot;
+
+
 bool GatewayDispatcher::start(const String &connectorString)
 {
 	if (connectorString.isEmpty())
@@ -26,7 +31,62 @@ bool GatewayDispatcher::start(const String &connectorString)
 void GatewayDispatcher::stop(unsigned timeout)
 {
 	NetServer::stop(timeout);
+
+	SyncLock lock(m_hostMutex);
 	m_hostMap = nullptr;
+	m_currentHostMap = nullptr;
+	m_retiredHostMaps.clear();
+}
+
+
+void GatewayDispatcher::setHostMap(GatewayHostMap *hostMap)
+{
+	{
+		SyncLock lock(m_hostMutex);
+
+		if (m_currentHostMap)
+		{
+			m_retiredHostMaps.push_back(m_currentHostMap);
+		}
+
+		m_currentHostMap = hostMap;
+		m_hostMap.store(hostMap);
+	}
+
+	// Providers, and their pools, are torn down here rather than on a thread
+	// that serves requests.
+	while (!reclaimHostMaps())
+	{
+		std::this_thread::yield();
+	}
+}
+
+bool GatewayDispatcher::reclaimHostMaps()
+{
+	std::set<GatewayHostMap*> hazards;
+	{
+		SyncLock lock(sm_hazardMutex);
+		for (HazardSlot *slot : sm_hazardSlots)
+		{
+			hazards.insert(slot->m_hostMap.load());
+		}
+	}
+
+	// Released after unlocking; tearing down providers can take a while.
+	std::vector<GatewayHostMapPtr> released;
+	{
+		SyncLock lock(m_hostMutex);
+
+		auto it = std::partition(
+			m_retiredHostMaps.begin(),
+			m_retiredHostMaps.end(),
+			[&hazards](const GatewayHostMapPtr &hostMap) { return hazards.count(hostMap) != 0; });
+
+		released.assign(it, m_retiredHostMaps.end());
+		m_retiredHostMaps.erase(it, m_retiredHostMaps.end());
+
+		return m_retiredHostMaps.empty();
+	}
 }
 
 
@@ -36,8 +96,19 @@ NetContext *GatewayDispatcher::createContext()
 }
 
 
-GatewayHostPtr GatewayDispatcher::lookupHost(const char *hostName)
+
+//////////////////////////////////////////////////////////////////////
+// class GatewayDispatcher::HazardSlot
+//
+
+GatewayDispatcher::HazardSlot::HazardSlot()
+{
+	SyncLock lock(sm_hazardMutex);
+	sm_hazardSlots.insert(this);
+}
+
+GatewayDispatcher::HazardSlot::~HazardSlot()
 {
-	SyncSharedLock lock(m_hostMutex);
-	return m_hostMap->lookup(hostName);
+	SyncLock lock(sm_hazardMutex);
+	sm_hazardSlots.erase(this);
 }
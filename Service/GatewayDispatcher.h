@@ -17,7 +17,8 @@ public:
 	String getConnectorString() const;
 
 	void setHostMap(GatewayHostMap *hostMap);
-	virtual GatewayHostPtr lookupHost(const char *hostName);
+	GatewayHostPtr lookupHost(const char *hostName);
+	virtual GatewayHostPtr lookupHost(const char *hostName, size_t length);
 
 	using NetServer::endContext;
 
@@ -25,10 +26,33 @@ protected:
 	virtual NetContext *createContext();
 
 private:
-	SyncMutex m_hostMutex;
 	String m_connectorString;
-	GatewayHostMapPtr m_hostMap;
 
+	// Lookups read the current snapshot without locking, publishing it in
+	// their thread's hazard slot first. A replaced map is released on the
+	// thread replacing it, the config monitor's, once no slot holds it; a
+	// lookup never blocks, so that wait is short.
+	class HazardSlot
+	{
+	public:
+		HazardSlot();
+		~HazardSlot();
+
+		std::atomic<GatewayHostMap *> m_hostMap{ nullptr };
+	};
+
+	std::atomic<GatewayHostMap *> m_hostMap{ nullptr };
+
+	SyncMutex m_hostMutex;
+	GatewayHostMapPtr m_currentHostMap;
+	std::vector<GatewayHostMapPtr> m_retiredHostMaps;
+
+	static SyncMutex sm_hazardMutex;
+	static std::set<HazardSlot*> sm_hazardSlots;
+	static thread_local HazardSlot st_hazardSlot;
+
+	// False while a retired map is still held.
+	bool reclaimHostMaps();
 };
 
 using GatewayDispatcherPtr = RefPointer<GatewayDispatcher>;
@@ -44,9 +68,32 @@ inline String GatewayDispatcher::getConnectorString() const
 	return m_connectorString;
 }
 
-inline void GatewayDispatcher::setHostMap(GatewayHostMap *hostMap)
+inline GatewayHostPtr GatewayDispatcher::lookupHost(const char *hostName)
 {
-	m_hostMutex.lock();
-	m_hostMap = hostMap;
-	m_hostMutex.unlock();
+	return lookupHost(hostName, strlen(hostName));
+}
+
+inline GatewayHostPtr GatewayDispatcher::lookupHost(const char *hostName, size_t length)
+{
+	HazardSlot &slot = st_hazardSlot;
+
+	// Once published, and still current, the map cannot be released
+	// until the slot is cleared.
+	GatewayHostMap *hostMap = m_hostMap.load();
+	for (;;)
+	{
+		slot.m_hostMap.store(hostMap);
+
+		GatewayHostMap *current = m_hostMap.load();
+		if (current == hostMap)
+		{
+			break;
+		}
+		hostMap = current;
+	}
+
+	GatewayHostPtr host = hostMap ? hostMap->lookup(hostName, length) : nullptr;
+	slot.m_hostMap.store(nullptr, std::memory_order_release);
+
+	return host;
 }
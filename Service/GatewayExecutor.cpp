@@ -0,0 +1,351 @@
+#include "pch.h"
+#include "GatewayExecutor.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayExecutor
+//
+
+std::vector<std::unique_ptr<GatewayExecutor::Worker>> GatewayExecutor::sm_workers;
+std::atomic<bool> GatewayExecutor::sm_running{ false };
+
+std::mutex GatewayExecutor::sm_timerMutex;
+std::condition_variable GatewayExecutor::sm_timerCondition;
+std::multimap<GatewayExecutor::clock_t::time_point, std::pair<unsigned, GatewayExecutor::task_t>> GatewayExecutor::sm_delayedTasks;
+std::thread GatewayExecutor::sm_timer;
+bool GatewayExecutor::sm_timerRunning{ false };
+bool GatewayExecutor::sm_timerStopped{ false };
+
+
+void GatewayExecutor::Start(size_t workerCount, bool pinWorkers)
+{
+	if (!sm_workers.empty())
+	{
+		return;
+	}
+
+	if (workerCount == 0)
+	{
+		workerCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	for (size_t index = 0; index < workerCount; ++index)
+	{
+		sm_workers.emplace_back(new Worker);
+	}
+
+	sm_running = true;
+
+	for (size_t index = 0; index < workerCount; ++index)
+	{
+		Worker &worker = *sm_workers[index];
+		worker.m_thread = std::thread([index]() { Run(index); });
+
+		if (pinWorkers && (index < (sizeof(DWORD_PTR) * 8)))
+		{
+			SetThreadAffinityMask(worker.m_thread.native_handle(), static_cast<DWORD_PTR>(1) << index);
+		}
+	}
+
+	AfxLogInfo("Started gateway executor with %u workers", static_cast<unsigned>(workerCount));
+}
+
+void GatewayExecutor::Stop()
+{
+	std::multimap<clock_t::time_point, std::pair<unsigned, task_t>> delayedTasks;
+	{
+		std::lock_guard<std::mutex> lock(sm_timerMutex);
+		sm_timerRunning = false;
+		sm_timerStopped = true;
+		delayedTasks.swap(sm_delayedTasks);
+	}
+	sm_timerCondition.notify_one();
+
+	if (sm_timer.joinable())
+	{
+		sm_timer.join();
+	}
+
+	if (!IsStarted())
+	{
+		return;
+	}
+
+	sm_running = false;
+
+	for (auto &worker : sm_workers)
+	{
+		{
+			std::lock_guard<std::mutex> lock(worker->m_mutex);
+		}
+		worker->m_condition.notify_one();
+	}
+
+	// Workers drain their own queues before exiting. They are kept, since
+	// pushes that raced the stop may still look at them.
+	for (auto &worker : sm_workers)
+	{
+		worker->m_thread.join();
+	}
+}
+
+
+unsigned GatewayExecutor::GetLocalWorker()
+{
+	return IsStarted() ? (GetCurrentProcessorNumber() % sm_workers.size()) : ANY_WORKER;
+}
+
+void GatewayExecutor::Push(unsigned index, task_t &&task)
+{
+	if (!IsStarted())
+	{
+		AfxPushIoProcess(std::move(task));
+		return;
+	}
+
+	if (index >= sm_workers.size())
+	{
+		index = GetLocalWorker();
+	}
+
+	Worker &worker = *sm_workers[index];
+
+	{
+		std::unique_lock<std::mutex> lock(worker.m_mutex);
+
+		// The executor stopped after the check above.
+		if (worker.m_stopped)
+		{
+			lock.unlock();
+			AfxPushIoProcess(std::move(task));
+			return;
+		}
+
+		worker.m_tasks.push_back(std::move(task));
+		worker.m_depth = worker.m_tasks.size();
+	}
+
+	// Prefer the home worker; if it is busy, or has more queued than it can
+	// take at once, let an idle one steal.
+	bool parked = worker.m_parked;
+	if (parked)
+	{
+		worker.m_condition.notify_one();
+	}
+	if (!parked || (worker.m_depth > 1))
+	{
+		WakeIdle(index);
+	}
+}
+
+
+void GatewayExecutor::PushAfter(unsigned worker, unsigned delay, task_t &&task)
+{
+	std::lock_guard<std::mutex> lock(sm_timerMutex);
+
+	if (sm_timerStopped)
+	{
+		return;
+	}
+
+	// The timer thread starts with the first delayed task.
+	if (!sm_timer.joinable())
+	{
+		sm_timerRunning = true;
+		sm_timer = std::thread([]() { RunTimer(); });
+	}
+
+	auto it = sm_delayedTasks.emplace(clock_t::now() + std::chrono::milliseconds(delay), std::make_pair(worker, std::move(task)));
+
+	// Only a new earliest task changes how long the timer sleeps.
+	if (it == sm_delayedTasks.begin())
+	{
+		sm_timerCondition.notify_one();
+	}
+}
+
+
+void GatewayExecutor::Run(size_t index)
+{
+	Worker &worker = *sm_workers[index];
+
+	for (;;)
+	{
+		task_t task;
+		if (worker.pop(task) || Steal(index, task))
+		{
+			RunTask(task);
+			worker.m_executed++;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(worker.m_mutex);
+		if (!worker.m_tasks.empty())
+		{
+			continue;
+		}
+
+		if (!sm_running)
+		{
+			worker.m_stopped = true;
+			break;
+		}
+
+		// Parked before looking at the other queues: a push from here on finds
+		// it parked and wakes it, and one before is seen and stolen.
+		worker.m_parked = true;
+		if (!HasQueuedTasks(index))
+		{
+			worker.m_condition.wait(lock);
+		}
+		worker.m_parked = false;
+	}
+}
+
+void GatewayExecutor::RunTask(task_t &task)
+{
+	// An escaping exception would take the worker, and the process, down.
+	try
+	{
+		task();
+	}
+	catch (Exception &x)
+	{
+		AfxLogError("Error running executor task - %s", x.getMessage());
+	}
+	catch (...)
+	{
+		AfxLogError("Error running executor task");
+	}
+}
+
+void GatewayExecutor::RunTimer()
+{
+	std::unique_lock<std::mutex> lock(sm_timerMutex);
+
+	while (sm_timerRunning)
+	{
+		if (sm_delayedTasks.empty())
+		{
+			sm_timerCondition.wait(lock);
+			continue;
+		}
+
+		auto it = sm_delayedTasks.begin();
+		if (clock_t::now() < it->first)
+		{
+			sm_timerCondition.wait_until(lock, it->first);
+			continue;
+		}
+
+		std::pair<unsigned, task_t> due = std::move(it->second);
+		sm_delayedTasks.erase(it);
+
+		lock.unlock();
+		Push(due.first, std::move(due.second));
+		lock.lock();
+	}
+}
+
+bool GatewayExecutor::Steal(size_t index, task_t &task)
+{
+	size_t count = sm_workers.size();
+	for (size_t offset = 1; offset < count; ++offset)
+	{
+		if (sm_workers[(index + offset) % count]->steal(task))
+		{
+			sm_workers[index]->m_stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool GatewayExecutor::HasQueuedTasks(size_t index)
+{
+	size_t count = sm_workers.size();
+	for (size_t offset = 1; offset < count; ++offset)
+	{
+		if (sm_workers[(index + offset) % count]->m_depth > 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void GatewayExecutor::WakeIdle(size_t index)
+{
+	size_t count = sm_workers.size();
+	for (size_t offset = 1; offset < count; ++offset)
+	{
+		Worker &worker = *sm_workers[(index + offset) % count];
+		if (worker.m_parked)
+		{
+			// Under its lock, the worker is either waiting, and is woken, or
+			// past its wait and about to look at the queues again.
+			std::lock_guard<std::mutex> lock(worker.m_mutex);
+			worker.m_condition.notify_one();
+			return;
+		}
+	}
+}
+
+
+void GatewayExecutor::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	if (!IsStarted())
+	{
+		return;
+	}
+
+	String labels;
+	for (size_t index = 0; index < sm_workers.size(); ++index)
+	{
+		Worker &worker = *sm_workers[index];
+
+		labels.format("worker=\"%u\"", static_cast<unsigned>(index));
+		writer.add("gateway_executor_queue_depth", worker.m_depth, labels);
+		writer.add("gateway_executor_tasks", worker.m_executed, labels);
+		writer.add("gateway_executor_steals", worker.m_stolen, labels);
+	}
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayExecutor::Worker
+//
+
+bool GatewayExecutor::Worker::pop(task_t &task)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_tasks.empty())
+	{
+		return false;
+	}
+
+	task = std::move(m_tasks.front());
+	m_tasks.pop_front();
+	m_depth = m_tasks.size();
+
+	return true;
+}
+
+bool GatewayExecutor::Worker::steal(task_t &task)
+{
+	// Never wait on a victim; a busy queue is simply skipped.
+	std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+
+	if (!lock.owns_lock() || m_tasks.empty())
+	{
+		return false;
+	}
+
+	task = std::move(m_tasks.back());
+	m_tasks.pop_back();
+	m_depth = m_tasks.size();
+
+	return true;
+}
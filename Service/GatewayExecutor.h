@@ -0,0 +1,89 @@
+#pragma once
+#include <condition_variable>
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayExecutor
+//
+// Runs request processing on one worker per core. Each worker owns a run
+// queue; contexts post to the worker of the core that accepted them, and
+// idle workers steal from busy ones. Until started, tasks go to the shared
+// AfxPushIoProcess pool, and once stopped, they go there again. Delayed
+// tasks wait on a timer thread until due, and are dropped if the executor
+// stops first, or arrive after it stopped.
+//
+
+class GatewayExecutor
+{
+public:
+	using task_t = std::function<void()>;
+
+	static const unsigned ANY_WORKER = UINT_MAX;
+
+	// A zero worker count starts one worker per logical processor. Workers
+	// start once per process; they are not restarted after a stop.
+	static void Start(size_t workerCount, bool pinWorkers);
+	static void Stop();
+
+	static bool IsStarted();
+
+	// Home worker for work originating on the current processor.
+	static unsigned GetLocalWorker();
+
+	static void Push(unsigned worker, task_t &&task);
+	static void PushAfter(unsigned worker, unsigned delay, task_t &&task);	// milliseconds
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	class Worker
+	{
+	public:
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+		std::deque<task_t> m_tasks;
+		std::thread m_thread;
+		bool m_stopped{ false };			// exited; takes no more tasks
+
+		std::atomic<bool> m_parked{ false };
+		std::atomic<size_t> m_depth{ 0 };
+		std::atomic<uint64_t> m_executed{ 0 };
+		std::atomic<uint64_t> m_stolen{ 0 };
+
+		bool pop(task_t &task);
+		bool steal(task_t &task);
+	};
+
+	// Filled before the workers start and never shrunk, so it can be read
+	// without a lock while running.
+	static std::vector<std::unique_ptr<Worker>> sm_workers;
+	static std::atomic<bool> sm_running;
+
+	using clock_t = std::chrono::steady_clock;
+
+	static std::mutex sm_timerMutex;
+	static std::condition_variable sm_timerCondition;
+	static std::multimap<clock_t::time_point, std::pair<unsigned, task_t>> sm_delayedTasks;
+	static std::thread sm_timer;
+	static bool sm_timerRunning;
+	static bool sm_timerStopped;
+
+	static void Run(size_t index);
+	static void RunTask(task_t &task);
+	static void RunTimer();
+	static bool Steal(size_t index, task_t &task);
+	static bool HasQueuedTasks(size_t index);
+	static void WakeIdle(size_t index);
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline bool GatewayExecutor::IsStarted()
+{
+	return sm_running;
+}
@@ -0,0 +1,478 @@
+#include "pch.h"
+#include "GatewayFileCache.h"
+
+
+static const String KEEP_ALIVE_CONNECTION = "Connection: keep-alive\r\n\r\n";
+static const String CLOSE_CONNECTION = "Connection: close\r\n\r\n";
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayFileCache::Entry
+//
+
+bool GatewayFileCache::Entry::isNotModified(const HttpRequest &request) const
+{
+	return GatewayFileTransfer::IsNotModified(request, m_etag, m_lastModified);
+}
+
+String GatewayFileCache::Entry::buildHead(bool notModified, bool keepAlive) const
+{
+	return (notModified ? m_notModifiedHead : m_head) + (keepAlive ? KEEP_ALIVE_CONNECTION : CLOSE_CONNECTION);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayFileCache
+//
+
+SyncMutex GatewayFileCache::sm_cacheMutex;
+std::set<GatewayFileCache*> GatewayFileCache::sm_caches;
+
+
+GatewayFileCache::GatewayFileCache(
+	const String &root,
+	const PropertyMap &responseHeaders,
+	const String &labels,
+	size_t capacity,
+	size_t maxFileSize,
+	size_t maxMissing) :
+	m_root(root),
+	m_responseHeaders(responseHeaders),
+	m_labels(labels),
+	m_capacity(capacity),
+	m_maxFileSize(maxFileSize),
+	m_maxMissing(maxMissing)
+{
+	HANDLE directory = CreateFileW(
+		GatewayFileTransfer::ToWidePath(m_root, m_root.getLength()).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+
+	if (directory == INVALID_HANDLE_VALUE)
+	{
+		AfxLogWarning("File cache disabled, cannot watch '%s' - %s", m_root, AfxFormatLastError());
+	}
+	else
+	{
+		m_stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		m_watcher = std::thread([this, directory]() mutable { watch(directory); });
+	}
+
+	SyncLock lock(sm_cacheMutex);
+	sm_caches.insert(this);
+}
+
+GatewayFileCache::~GatewayFileCache()
+{
+	{
+		SyncLock lock(sm_cacheMutex);
+		sm_caches.erase(this);
+	}
+
+	if (m_watcher.joinable())
+	{
+		SetEvent(m_stopEvent);
+		m_watcher.join();
+	}
+
+	if (m_stopEvent)
+	{
+		CloseHandle(m_stopEvent);
+	}
+}
+
+
+GatewayFileCache::EntryPtr GatewayFileCache::lookup(const String &path, unsigned acceptedEncodings)
+{
+	if (!m_watching || !m_capacity)
+	{
+		return nullptr;
+	}
+
+	String key = MakeKey(path, acceptedEncodings);
+
+	SyncLock lock(m_mutex);
+
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+	{
+		m_missCount++;
+		return nullptr;
+	}
+
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	m_hitCount++;
+
+	return *it->second;
+}
+
+GatewayFileCache::EntryPtr GatewayFileCache::load(const String &path, unsigned acceptedEncodings, const GatewayFileSource &source)
+{
+	if (!m_watching || !m_capacity)
+	{
+		return nullptr;
+	}
+
+	// A change seen while reading means the entry may already be stale.
+	uint64_t generation;
+	{
+		SyncLock lock(m_mutex);
+		generation = m_generation;
+	}
+
+	EntryPtr entry = build(MakeKey(path, acceptedEncodings), source);
+	if (!entry)
+	{
+		return nullptr;
+	}
+
+	SyncLock lock(m_mutex);
+
+	if (generation == m_generation)
+	{
+		auto it = m_index.find(entry->m_key);
+		if (it != m_index.end())
+		{
+			m_size -= (*it->second)->getSize();
+			m_entries.erase(it->second);
+		}
+
+		m_entries.push_front(entry);
+		m_index[entry->m_key] = m_entries.begin();
+		m_size += entry->getSize();
+
+		trim();
+	}
+
+	return entry;
+}
+
+
+bool GatewayFileCache::isMissing(const String &path, uint64_t &generation)
+{
+	if (!m_watching || !m_maxMissing)
+	{
+		return false;
+	}
+
+	String key = MakeKey(path, path.getLength());
+
+	SyncLock lock(m_mutex);
+
+	generation = m_generation;
+
+	auto it = m_missingIndex.find(key);
+	if (it == m_missingIndex.end())
+	{
+		m_missingMissCount++;
+		return false;
+	}
+
+	m_missing.splice(m_missing.begin(), m_missing, it->second);
+	m_missingHitCount++;
+
+	return true;
+}
+
+void GatewayFileCache::addMissing(const String &path, uint64_t generation)
+{
+	if (!m_watching || !m_maxMissing)
+	{
+		return;
+	}
+
+	String key = MakeKey(path, path.getLength());
+
+	SyncLock lock(m_mutex);
+
+	if ((generation != m_generation) || (m_missingIndex.find(key) != m_missingIndex.end()))
+	{
+		return;
+	}
+
+	m_missing.push_front(key);
+	m_missingIndex[key] = m_missing.begin();
+
+	while (m_missing.size() > m_maxMissing)
+	{
+		m_missingIndex.erase(m_missing.back());
+		m_missing.pop_back();
+	}
+}
+
+
+String GatewayFileCache::MakeKey(const char *path, size_t length)
+{
+	std::vector<char> key(path, path + length);
+	bool ascii = true;
+
+	for (char &c : key)
+	{
+		if ((c >= 'A') && (c <= 'Z'))
+		{
+			c += 'a' - 'A';
+		}
+		else if (c == '\\')
+		{
+			c = '/';
+		}
+		else if (c & 0x80)
+		{
+			ascii = false;
+		}
+	}
+
+	// Names are matched case-insensitively, as the file system does.
+	if (!ascii)
+	{
+		std::wstring wideKey = GatewayFileTransfer::ToWidePath(key.data(), key.size());
+		if (!wideKey.empty())
+		{
+			CharLowerBuffW(&wideKey[0], static_cast<DWORD>(wideKey.size()));
+			return GatewayFileTransfer::FromWidePath(wideKey.c_str(), wideKey.size());
+		}
+	}
+
+	return String(key.data(), key.size());
+}
+
+String GatewayFileCache::MakeKey(const String &path, unsigned acceptedEncodings)
+{
+	String key = MakeKey(path, path.getLength());
+	if (acceptedEncodings)
+	{
+		// Not a path character, so it cannot collide with a real path.
+		key += String("\n%u", acceptedEncodings);
+	}
+	return key;
+}
+
+
+GatewayFileCache::EntryPtr GatewayFileCache::build(const String &key, const GatewayFileSource &source) const
+{
+	HANDLE handle = CreateFileW(
+		GatewayFileTransfer::ToWidePath(source.m_fileName, source.m_fileName.getLength()).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+
+	std::vector<char> body;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	bool succeeded = GetFileInformationByHandle(handle, &info) && !info.nFileSizeHigh && (info.nFileSizeLow <= m_maxFileSize);
+	if (succeeded)
+	{
+		body.resize(info.nFileSizeLow);
+
+		DWORD offset = 0;
+		while (succeeded && (offset < info.nFileSizeLow))
+		{
+			DWORD count = 0;
+			succeeded = ReadFile(handle, body.data() + offset, info.nFileSizeLow - offset, &count, nullptr) && (count > 0);
+			offset += count;
+		}
+	}
+
+	CloseHandle(handle);
+
+	if (!succeeded)
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+
+	entry->m_body = String(body.data(), body.size());
+	entry->m_key = key;
+	entry->m_file = MakeKey(source.m_relativeName, source.m_relativeName.getLength());
+	if (!source.m_encoding.isEmpty())
+	{
+		entry->m_sourceFile = MakeKey(source.m_sourceName, source.m_sourceName.getLength());
+	}
+	entry->m_etag = GatewayFileTransfer::FormatETag(info.ftLastWriteTime, info.nFileSizeLow, source.m_encoding);
+	entry->m_lastModified = GatewayFileTransfer::FormatHttpDate(info.ftLastWriteTime);
+
+	String validators = GatewayFileTransfer::FormatValidators(entry->m_etag, entry->m_lastModified, source);
+
+	entry->m_notModifiedHead = "HTTP/1.1 304 Not Modified\r\n" + validators;
+
+	entry->m_head.format(
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %u\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"%s",
+		GatewayFileTransfer::LookupContentType(source.m_sourceName),
+		static_cast<unsigned>(info.nFileSizeLow),
+		validators);
+
+	for (auto current : m_responseHeaders)
+	{
+		entry->m_head += String("%s: %s\r\n", current.first, current.second);
+	}
+
+	return entry;
+}
+
+
+void GatewayFileCache::watch(HANDLE directory)
+{
+	static const DWORD NOTIFY_FILTER =
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+	std::vector<DWORD> buffer(16384);
+
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	HANDLE events[] = { m_stopEvent, overlapped.hEvent };
+
+	for (;;)
+	{
+		ResetEvent(overlapped.hEvent);
+
+		if (!ReadDirectoryChangesW(
+			directory, buffer.data(), static_cast<DWORD>(buffer.size() * sizeof(DWORD)), TRUE, NOTIFY_FILTER, nullptr, &overlapped, nullptr))
+		{
+			AfxLogWarning("File cache disabled, cannot watch '%s' - %s", m_root, AfxFormatLastError());
+			break;
+		}
+
+		m_watching = true;
+
+		DWORD count = 0;
+		if ((WaitForMultipleObjects(2, events, FALSE, INFINITE) != (WAIT_OBJECT_0 + 1))
+			|| !GetOverlappedResult(directory, &overlapped, &count, FALSE))
+		{
+			CancelIo(directory);
+			GetOverlappedResult(directory, &overlapped, &count, TRUE);
+			break;
+		}
+
+		// An empty result means the change buffer overflowed.
+		if (count == 0)
+		{
+			clear();
+			continue;
+		}
+
+		const BYTE *cursor = reinterpret_cast<const BYTE *>(buffer.data());
+		for (;;)
+		{
+			const FILE_NOTIFY_INFORMATION *info = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(cursor);
+
+			String name = GatewayFileTransfer::FromWidePath(info->FileName, info->FileNameLength / sizeof(WCHAR));
+			String file = MakeKey(name, name.getLength());
+
+			// New names can change how requests resolve (default files and
+			// extensions) and are the only changes that make a missing path
+			// exist.
+			bool resolvesDifferently = (info->Action == FILE_ACTION_ADDED) || (info->Action == FILE_ACTION_RENAMED_NEW_NAME);
+			if (resolvesDifferently || file.isEmpty())
+			{
+				clear();
+			}
+			else
+			{
+				invalidate(file);
+			}
+
+			if (!info->NextEntryOffset)
+			{
+				break;
+			}
+			cursor += info->NextEntryOffset;
+		}
+	}
+
+	m_watching = false;
+	clear();
+
+	CloseHandle(overlapped.hEvent);
+	CloseHandle(directory);
+}
+
+void GatewayFileCache::invalidate(const String &file)
+{
+	SyncLock lock(m_mutex);
+
+	m_generation++;
+
+	// Entries for the file itself, or anything under it if it is a directory.
+	size_t length = file.getLength();
+	auto matches =
+		[&file, length](const String &entryFile)
+		{
+			return (entryFile.getLength() >= length)
+				&& (memcmp(static_cast<const char *>(entryFile), static_cast<const char *>(file), length) == 0)
+				&& ((entryFile.getLength() == length) || (entryFile[length] == '/'));
+		};
+
+	for (auto it = m_entries.begin(); it != m_entries.end(); )
+	{
+		if (matches((*it)->m_file) || matches((*it)->m_sourceFile))
+		{
+			m_size -= (*it)->getSize();
+			m_index.erase((*it)->m_key);
+			it = m_entries.erase(it);
+			m_invalidationCount++;
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void GatewayFileCache::clear()
+{
+	SyncLock lock(m_mutex);
+
+	m_generation++;
+	m_invalidationCount += m_entries.size();
+
+	m_entries.clear();
+	m_index.clear();
+	m_size = 0;
+
+	m_missing.clear();
+	m_missingIndex.clear();
+}
+
+void GatewayFileCache::trim()
+{
+	// Called locked.
+	while ((m_size > m_capacity) && !m_entries.empty())
+	{
+		m_size -= m_entries.back()->getSize();
+		m_index.erase(m_entries.back()->m_key);
+		m_entries.pop_back();
+		m_evictionCount++;
+	}
+}
+
+
+void GatewayFileCache::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	SyncLock registryLock(sm_cacheMutex);
+
+	for (GatewayFileCache *cache : sm_caches)
+	{
+		const char *labels = cache->m_labels;
+		writer.add("gateway_file_cache_hits", cache->m_hitCount, labels);
+		writer.add("gateway_file_cache_misses", cache->m_missCount, labels);
+		writer.add("gateway_file_cache_evictions", cache->m_evictionCount, labels);
+		writer.add("gateway_file_cache_invalidations", cache->m_invalidationCount, labels);
+		writer.add("gateway_file_cache_missing_hits", cache->m_missingHitCount, labels);
+		writer.add("gateway_file_cache_missing_misses", cache->m_missingMissCount, labels);
+
+		SyncLock lock(cache->m_mutex);
+		writer.add("gateway_file_cache_entries", cache->m_entries.size(), labels);
+		writer.add("gateway_file_cache_bytes", cache->m_size, labels);
+		writer.add("gateway_file_cache_missing_entries", cache->m_missing.size(), labels);
+	}
+}
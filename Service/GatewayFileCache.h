@@ -0,0 +1,124 @@
+#pragma once
+#include <list>
+#include "GatewayMetrics.h"
+#include "GatewayFileTransfer.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayFileCache
+//
+// Holds small, hot files of a file provider in memory along with their
+// serialized response heads, so hits and conditional requests are answered
+// without touching disk. A watcher thread drops entries when anything under
+// the target directory changes; nothing is served while it is not running.
+// Paths known not to exist are remembered too, so repeated misses skip the
+// file system probes.
+//
+
+class GatewayFileCache : public RefCounter
+{
+public:
+	class Entry
+	{
+	public:
+		String m_key;				// lower-cased request path and accepted encodings
+		String m_file;				// lower-cased, relative to the root
+		String m_sourceFile;		// the requested file, if a sibling is sent
+		String m_etag;
+		String m_lastModified;
+		String m_head;				// status line and headers, no Connection
+		String m_notModifiedHead;
+		String m_body;				// written after the head, never copied into it
+
+		bool isNotModified(const HttpRequest &request) const;
+		String buildHead(bool notModified, bool keepAlive) const;
+
+		size_t getSize() const;
+	};
+
+	using EntryPtr = std::shared_ptr<const Entry>;
+
+	GatewayFileCache(
+		const String &root,
+		const PropertyMap &responseHeaders,
+		const String &labels,
+		size_t capacity,
+		size_t maxFileSize,
+		size_t maxMissing);
+	virtual ~GatewayFileCache();
+
+	size_t getMaxFileSize() const;
+
+	// Requests accepting different sets of encodings are cached apart.
+	EntryPtr lookup(const String &path, unsigned acceptedEncodings);
+
+	// Reads the file a request resolved to; null if it cannot be cached.
+	EntryPtr load(const String &path, unsigned acceptedEncodings, const GatewayFileSource &source);
+
+	// True if the path was last found missing. The generation seen is passed
+	// back to addMissing, so a file created meanwhile is not hidden.
+	bool isMissing(const String &path, uint64_t &generation);
+	void addMissing(const String &path, uint64_t generation);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	String m_root;
+	PropertyMap m_responseHeaders;
+	String m_labels;
+
+	size_t m_capacity;
+	size_t m_maxFileSize;
+	size_t m_maxMissing;
+
+	SyncMutex m_mutex;
+	std::list<EntryPtr> m_entries;		// most recently used first
+	std::unordered_map<String, std::list<EntryPtr>::iterator> m_index;
+	size_t m_size{ 0 };
+	uint64_t m_generation{ 0 };
+
+	std::list<String> m_missing;		// most recently used first
+	std::unordered_map<String, std::list<String>::iterator> m_missingIndex;
+
+	std::atomic<uint64_t> m_hitCount{ 0 };
+	std::atomic<uint64_t> m_missCount{ 0 };
+	std::atomic<uint64_t> m_evictionCount{ 0 };
+	std::atomic<uint64_t> m_invalidationCount{ 0 };
+	std::atomic<uint64_t> m_missingHitCount{ 0 };
+	std::atomic<uint64_t> m_missingMissCount{ 0 };
+
+	std::thread m_watcher;
+	HANDLE m_stopEvent{ nullptr };
+	std::atomic<bool> m_watching{ false };
+
+	static SyncMutex sm_cacheMutex;
+	static std::set<GatewayFileCache*> sm_caches;
+
+	static String MakeKey(const char *path, size_t length);
+	static String MakeKey(const String &path, unsigned acceptedEncodings);
+
+	EntryPtr build(const String &key, const GatewayFileSource &source) const;
+
+	void watch(HANDLE directory);
+	void invalidate(const String &file);
+	void clear();
+	void trim();
+};
+
+using GatewayFileCachePtr = RefPointer<GatewayFileCache>;
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline size_t GatewayFileCache::getMaxFileSize() const
+{
+	return m_maxFileSize;
+}
+
+inline size_t GatewayFileCache::Entry::getSize() const
+{
+	return m_key.getLength() + m_file.getLength() + m_sourceFile.getLength() + m_head.getLength() + m_notModifiedHead.getLength() + m_body.getLength();
+}
@@ -0,0 +1,504 @@
+#include "pch.h"
+#include "GatewayContext.h"
+#include "GatewayBufferPool.h"
+#include "GatewayFileTransfer.h"
+
+
+static const String IF_NONE_MATCH_HEADER = "If-None-Match";
+static const String IF_MODIFIED_SINCE_HEADER = "If-Modified-Since";
+
+
+static inline void __SkipSpace(const char *&cursor, const char *end)
+{
+	while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t')))
+	{
+		cursor++;
+	}
+}
+
+static bool __ParseNumber(const char *&cursor, const char *end, uint64_t &value)
+{
+	const char *start = cursor;
+
+	value = 0;
+	while ((cursor < end) && (*cursor >= '0') && (*cursor <= '9'))
+	{
+		uint64_t digit = *cursor++ - '0';
+		if (value > ((UINT64_MAX - digit) / 10))
+		{
+			return false;
+		}
+		value = (value * 10) + digit;
+	}
+
+	return cursor > start;
+}
+
+static bool __MatchesETag(const String &tags, const String &etag)
+{
+	// Weak comparison over a comma-separated list, or "*".
+	const char *cursor = tags;
+	const char *end = cursor + tags.getLength();
+
+	while (cursor < end)
+	{
+		while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t') || (*cursor == ',')))
+		{
+			cursor++;
+		}
+
+		const char *tag = cursor;
+		while ((cursor < end) && (*cursor != ','))
+		{
+			cursor++;
+		}
+
+		const char *tagEnd = cursor;
+		while ((tagEnd > tag) && ((tagEnd[-1] == ' ') || (tagEnd[-1] == '\t')))
+		{
+			tagEnd--;
+		}
+
+		if (((tagEnd - tag) >= 2) && (tag[0] == 'W') && (tag[1] == '/'))
+		{
+			tag += 2;
+		}
+
+		size_t length = tagEnd - tag;
+		if (((length == 1) && (*tag == '*')) || ((length == etag.getLength()) && (memcmp(tag, etag, length) == 0)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayFileTransfer
+//
+
+GatewayFileTransfer::RangeResult GatewayFileTransfer::ParseRanges(const String &header, uint64_t size, std::vector<Range> &ranges)
+{
+	static const char BYTES_UNIT[] = "bytes=";
+	static const size_t BYTES_UNIT_LENGTH = sizeof(BYTES_UNIT) - 1;
+
+	const char *cursor = header;
+	const char *end = cursor + header.getLength();
+
+	__SkipSpace(cursor, end);
+	if ((static_cast<size_t>(end - cursor) < BYTES_UNIT_LENGTH) || (_strnicmp(cursor, BYTES_UNIT, BYTES_UNIT_LENGTH) != 0))
+	{
+		return RangeResult::NONE;
+	}
+	cursor += BYTES_UNIT_LENGTH;
+
+	ranges.clear();
+
+	size_t specCount = 0;
+	while (cursor < end)
+	{
+		__SkipSpace(cursor, end);
+		if ((cursor < end) && (*cursor == ','))
+		{
+			cursor++;
+			continue;
+		}
+
+		uint64_t first;
+		uint64_t last;
+
+		if ((cursor < end) && (*cursor == '-'))
+		{
+			// Suffix range: the last n bytes.
+			cursor++;
+
+			uint64_t count;
+			if (!__ParseNumber(cursor, end, count))
+			{
+				return RangeResult::NONE;
+			}
+
+			first = (count < size) ? (size - count) : 0;
+			last = size - 1;
+
+			if ((count == 0) || (size == 0))
+			{
+				first = size;
+			}
+		}
+		else
+		{
+			if (!__ParseNumber(cursor, end, first) || (cursor == end) || (*cursor++ != '-'))
+			{
+				return RangeResult::NONE;
+			}
+
+			if (!__ParseNumber(cursor, end, last))
+			{
+				last = UINT64_MAX;
+			}
+			else if (last < first)
+			{
+				return RangeResult::NONE;
+			}
+
+			if (last >= size)
+			{
+				last = size - 1;
+			}
+		}
+
+		__SkipSpace(cursor, end);
+		if ((cursor < end) && (*cursor != ','))
+		{
+			return RangeResult::NONE;
+		}
+
+		// Too many ranges is treated as no range at all.
+		if (++specCount > MAX_RANGES)
+		{
+			ranges.clear();
+			return RangeResult::NONE;
+		}
+
+		if (first < size)
+		{
+			ranges.push_back({ first, last });
+		}
+	}
+
+	if (specCount == 0)
+	{
+		return RangeResult::NONE;
+	}
+
+	return ranges.empty() ? RangeResult::UNSATISFIABLE : RangeResult::SATISFIABLE;
+}
+
+
+std::wstring GatewayFileTransfer::ToWidePath(const char *path, size_t length)
+{
+	std::wstring widePath;
+
+	int wideLength = length ? MultiByteToWideChar(CP_UTF8, 0, path, static_cast<int>(length), nullptr, 0) : 0;
+	if (wideLength > 0)
+	{
+		widePath.resize(wideLength);
+		MultiByteToWideChar(CP_UTF8, 0, path, static_cast<int>(length), &widePath[0], wideLength);
+	}
+
+	return widePath;
+}
+
+String GatewayFileTransfer::FromWidePath(const WCHAR *path, size_t length)
+{
+	int narrowLength = length ? WideCharToMultiByte(CP_UTF8, 0, path, static_cast<int>(length), nullptr, 0, nullptr, nullptr) : 0;
+	if (narrowLength <= 0)
+	{
+		return String();
+	}
+
+	std::vector<char> narrowPath(narrowLength);
+	WideCharToMultiByte(CP_UTF8, 0, path, static_cast<int>(length), narrowPath.data(), narrowLength, nullptr, nullptr);
+
+	return String(narrowPath.data(), narrowPath.size());
+}
+
+
+String GatewayFileTransfer::LookupContentType(const String &file)
+{
+	const char *extension = strrchr(file, '.');
+
+	if (extension && !strchr(extension, '/') && !strchr(extension, '\\'))
+	{
+		char type[128];
+		DWORD size = sizeof(type);
+		if (RegGetValueA(HKEY_CLASSES_ROOT, extension, "Content Type", RRF_RT_REG_SZ, nullptr, type, &size) == ERROR_SUCCESS)
+		{
+			return type;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+String GatewayFileTransfer::FormatHttpDate(const FILETIME &fileTime)
+{
+	static const char *DAYS[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char *MONTHS[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	SYSTEMTIME time;
+	FileTimeToSystemTime(&fileTime, &time);
+
+	return String(
+		"%s, %02u %s %04u %02u:%02u:%02u GMT",
+		DAYS[time.wDayOfWeek], time.wDay, MONTHS[time.wMonth - 1], time.wYear, time.wHour, time.wMinute, time.wSecond);
+}
+
+String GatewayFileTransfer::FormatETag(const FILETIME &lastWriteTime, uint64_t size, const String &encoding)
+{
+	// Each encoding is its own representation.
+	return String(
+		"\"%08lx%08lx-%llx%s%s\"",
+		lastWriteTime.dwHighDateTime, lastWriteTime.dwLowDateTime, static_cast<unsigned long long>(size),
+		encoding.isEmpty() ? "" : "-", encoding);
+}
+
+String GatewayFileTransfer::FormatValidators(const String &etag, const String &lastModified, const GatewayFileSource &source)
+{
+	String headers("ETag: %s\r\nLast-Modified: %s\r\n", etag, lastModified);
+
+	if (!source.m_encoding.isEmpty())
+	{
+		headers += String("Content-Encoding: %s\r\n", source.m_encoding);
+	}
+
+	if (source.m_vary)
+	{
+		headers += "Vary: Accept-Encoding\r\n";
+	}
+
+	return headers;
+}
+
+bool GatewayFileTransfer::IsNotModified(const HttpRequest &request, const String &etag, const String &lastModified)
+{
+	String tags = request.getHeader(IF_NONE_MATCH_HEADER);
+	if (!tags.isEmpty())
+	{
+		return __MatchesETag(tags, etag);
+	}
+
+	String since = request.getHeader(IF_MODIFIED_SINCE_HEADER);
+	return !since.isEmpty() && (since == lastModified);
+}
+
+
+GatewayFileTransfer::GatewayFileTransfer(GatewayContext *context, bool keepAlive) :
+	m_context(context),
+	m_keepAlive(keepAlive)
+{
+}
+
+GatewayFileTransfer::~GatewayFileTransfer()
+{
+	freeBuffer();
+
+	// No read is outstanding once the last reference is gone.
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+
+	if (m_io)
+	{
+		CloseThreadpoolIo(m_io);
+	}
+}
+
+
+bool GatewayFileTransfer::open(const String &fileName, uint64_t &size, FILETIME &lastWriteTime)
+{
+	m_file = CreateFileW(
+		ToWidePath(fileName, fileName.getLength()).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if ((m_file == INVALID_HANDLE_VALUE) || !GetFileInformationByHandle(m_file, &info))
+	{
+		return false;
+	}
+
+	size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	lastWriteTime = info.ftLastWriteTime;
+
+	// Empty files have nothing to read.
+	if (size > 0)
+	{
+		m_io = CreateThreadpoolIo(m_file, OnRead, this, nullptr);
+		if (!m_io)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint64_t GatewayFileTransfer::getContentLength() const
+{
+	uint64_t length = m_trailer.getLength();
+	for (const Segment &segment : m_segments)
+	{
+		length += segment.m_prefix.getLength() + segment.m_length;
+	}
+	return length;
+}
+
+
+void GatewayFileTransfer::send()
+{
+	// The head goes out with the first prefix.
+	if (m_segments.empty())
+	{
+		m_trailer = m_head + m_trailer;
+	}
+	else
+	{
+		m_segments[0].m_prefix = m_head + m_segments[0].m_prefix;
+	}
+	m_head.clear();
+
+	sendNext();
+}
+
+void GatewayFileTransfer::sendNext()
+{
+	GatewayFileTransferPtr self = this;
+
+	auto next =
+		[this, self](IoState *state) mutable
+		{
+			if (state->succeeded())
+			{
+				sendNext();
+			}
+			else
+			{
+				end(false);
+			}
+		};
+
+	while (m_segment < m_segments.size())
+	{
+		Segment &segment = m_segments[m_segment];
+
+		if (!m_prefixSent)
+		{
+			m_prefixSent = true;
+			if (!segment.m_prefix.isEmpty())
+			{
+				m_context->getStream()->write(static_cast<const char *>(segment.m_prefix), segment.m_prefix.getLength(), std::move(next));
+				return;
+			}
+		}
+
+		if (m_sent < segment.m_length)
+		{
+			readNext(segment);
+			return;
+		}
+
+		m_segment++;
+		m_prefixSent = false;
+		m_sent = 0;
+	}
+
+	if (!m_trailerSent && !m_trailer.isEmpty())
+	{
+		m_trailerSent = true;
+		m_context->getStream()->write(static_cast<const char *>(m_trailer), m_trailer.getLength(), std::move(next));
+		return;
+	}
+
+	end(true);
+}
+
+void GatewayFileTransfer::readNext(const Segment &segment)
+{
+	uint64_t offset = segment.m_offset + m_sent;
+	uint64_t remaining = segment.m_length - m_sent;
+	DWORD length = static_cast<DWORD>((remaining < READ_SIZE) ? remaining : READ_SIZE);
+
+	m_buffer = GatewayBufferPool::Alloc(READ_SIZE);
+
+	m_overlapped = {};
+	m_overlapped.Offset = static_cast<DWORD>(offset);
+	m_overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	// Held for the read; OnRead gives it back.
+	__incRef();
+	StartThreadpoolIo(m_io);
+
+	if (!ReadFile(m_file, m_buffer, length, nullptr, &m_overlapped) && (GetLastError() != ERROR_IO_PENDING))
+	{
+		DWORD error = GetLastError();
+		CancelThreadpoolIo(m_io);
+
+		GatewayFileTransferPtr self = this;
+		__decRef();
+
+		sendRead(error, 0);
+	}
+}
+
+VOID CALLBACK GatewayFileTransfer::OnRead(PTP_CALLBACK_INSTANCE instance, PVOID context, PVOID overlapped, ULONG result, ULONG_PTR count, PTP_IO io)
+{
+	GatewayFileTransfer *transfer = static_cast<GatewayFileTransfer *>(context);
+
+	GatewayFileTransferPtr self = transfer;
+	transfer->__decRef();
+
+	// Continue on the context's worker rather than the system thread pool.
+	transfer->m_context->post(
+		[transfer, self, result, count]() mutable
+		{
+			transfer->sendRead(result, static_cast<size_t>(count));
+		}
+	);
+}
+
+void GatewayFileTransfer::sendRead(ULONG result, size_t count)
+{
+	// The head already promised every byte, so a file cut short since it was
+	// opened, or a failed read, can only end the connection.
+	if ((result != NO_ERROR) || (count == 0))
+	{
+		if (result != ERROR_HANDLE_EOF)
+		{
+			AfxLogError("Error reading file for transfer - error %u", static_cast<unsigned>(result));
+		}
+
+		end(false);
+		return;
+	}
+
+	GatewayFileTransferPtr self = this;
+
+	m_context->getStream()->write(
+		m_buffer, count,
+		[this, self, count](IoState *state) mutable
+		{
+			freeBuffer();
+
+			if (state->succeeded())
+			{
+				m_sent += count;
+				sendNext();
+			}
+			else
+			{
+				end(false);
+			}
+		}
+	);
+}
+
+void GatewayFileTransfer::end(bool succeeded)
+{
+	freeBuffer();
+
+	m_context->endResponse(succeeded, m_keepAlive);
+}
+
+void GatewayFileTransfer::freeBuffer()
+{
+	if (m_buffer)
+	{
+		GatewayBufferPool::Free(m_buffer, READ_SIZE);
+		m_buffer = nullptr;
+	}
+}
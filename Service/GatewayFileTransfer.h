@@ -0,0 +1,145 @@
+#pragma once
+
+
+class GatewayContext;
+
+
+//////////////////////////////////////////////////////////////////////////
+// struct GatewayFileSource
+//
+// A file a request resolved to. With an encoding, the file sent is a
+// precompressed sibling of the requested one.
+//
+
+struct GatewayFileSource
+{
+	String m_fileName;			// full path of the file sent
+	String m_relativeName;		// of the file sent, relative to the root
+	String m_sourceName;		// of the file requested; gives the content type
+	String m_encoding;
+	uint64_t m_size{ 0 };
+	bool m_vary{ false };		// the choice depends on Accept-Encoding
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayFileTransfer
+//
+// Sends a file, or ranges of it, to the client stream in overlapped reads
+// through a pooled buffer, checked out only while a read or write is under
+// way. The response is a list of segments, each a prefix (the head, or a
+// multipart part header) followed by a span of the file, and a final
+// trailer. The size is taken when the file is opened; the file is neither
+// mapped nor locked, so it can be rewritten meanwhile, and if it is cut
+// short, the response is aborted.
+//
+
+class GatewayFileTransfer : public RefCounter
+{
+public:
+	struct Range
+	{
+		uint64_t m_first;
+		uint64_t m_last;		// inclusive
+	};
+
+	enum class RangeResult
+	{
+		NONE,					// absent, malformed or ignored
+		SATISFIABLE,
+		UNSATISFIABLE
+	};
+
+	static const size_t MAX_RANGES = 16;
+
+	static RangeResult ParseRanges(const String &header, uint64_t size, std::vector<Range> &ranges);
+
+	// Request paths are UTF-8, while the file system is addressed in UTF-16,
+	// so names outside the ANSI code page resolve as well.
+	static std::wstring ToWidePath(const char *path, size_t length);
+	static String FromWidePath(const WCHAR *path, size_t length);
+
+	static String LookupContentType(const String &file);
+	static String FormatHttpDate(const FILETIME &fileTime);
+	static String FormatETag(const FILETIME &lastWriteTime, uint64_t size, const String &encoding);
+
+	// If-None-Match takes precedence; dates are matched as sent back to us.
+	static bool IsNotModified(const HttpRequest &request, const String &etag, const String &lastModified);
+
+	// Validators and negotiation headers shared by full, partial and 304 responses.
+	static String FormatValidators(const String &etag, const String &lastModified, const GatewayFileSource &source);
+
+	GatewayFileTransfer(GatewayContext *context, bool keepAlive);
+	virtual ~GatewayFileTransfer();
+
+	bool open(const String &fileName, uint64_t &size, FILETIME &lastWriteTime);
+
+	// The content length covers segments and trailer, not the head.
+	void setHead(const String &head);
+	void addSegment(const String &prefix, uint64_t offset, uint64_t length);
+	void setTrailer(const String &trailer);
+	uint64_t getContentLength() const;
+
+	void send();
+
+private:
+	struct Segment
+	{
+		String m_prefix;
+		uint64_t m_offset;
+		uint64_t m_length;
+	};
+
+	// Bytes read, and written, at a time.
+	static const size_t READ_SIZE = 262144;
+
+	// Held for the transfer's life; reads complete on system threads, which
+	// must find the context still there.
+	RefPointer<GatewayContext> m_context;
+	bool m_keepAlive;
+
+	HANDLE m_file{ INVALID_HANDLE_VALUE };
+	PTP_IO m_io{ nullptr };
+	OVERLAPPED m_overlapped{};
+	char *m_buffer{ nullptr };
+
+	String m_head;
+	std::vector<Segment> m_segments;
+	String m_trailer;
+
+	size_t m_segment{ 0 };
+	bool m_prefixSent{ false };
+	bool m_trailerSent{ false };
+	uint64_t m_sent{ 0 };
+
+	void sendNext();
+	void readNext(const Segment &segment);
+	void sendRead(ULONG result, size_t count);
+	void end(bool succeeded);
+	void freeBuffer();
+
+	static VOID CALLBACK OnRead(PTP_CALLBACK_INSTANCE instance, PVOID context, PVOID overlapped, ULONG result, ULONG_PTR count, PTP_IO io);
+};
+
+using GatewayFileTransferPtr = RefPointer<GatewayFileTransfer>;
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline void GatewayFileTransfer::setHead(const String &head)
+{
+	m_head = head;
+}
+
+inline void GatewayFileTransfer::addSegment(const String &prefix, uint64_t offset, uint64_t length)
+{
+	m_segments.push_back({ prefix, offset, length });
+}
+
+inline void GatewayFileTransfer::setTrailer(const String &trailer)
+{
+	m_trailer = trailer;
+}
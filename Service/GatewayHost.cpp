@@ -2,6 +2,376 @@
 #include "GatewayHost.h"
 
 
+static inline char __LowerAscii(char c)
+{
+	return ((c >= 'A') && (c <= 'Z')) ? (c + ('a' - 'A')) : c;
+}
+
+
+
 //////////////////////////////////////////////////////////////////////////
 // class GatewayHost
 //
+
+GatewayProviderPtr GatewayHost::lookupProvider(const char *path, size_t length, size_t *mountLength) const
+{
+	// Try the whole path, then each prefix ending before a '/'.
+	for (size_t end = length; ; --end)
+	{
+		if ((end == length) || (path[end] == '/'))
+		{
+			const Route *route = findRoute(path, end);
+			if (route)
+			{
+				if (mountLength)
+				{
+					*mountLength = end;
+				}
+				return m_providers[route->m_provider];
+			}
+		}
+
+		if (end == 0)
+		{
+			break;
+		}
+	}
+
+	return nullptr;
+}
+
+void GatewayHost::addProvider(const char *path, GatewayProvider *provider)
+{
+	// Mounts are stored without a trailing '/', so the root mount is empty.
+	std::string mount(path);
+	while (!mount.empty() && (mount.back() == '/'))
+	{
+		mount.pop_back();
+	}
+	if (!mount.empty() && (mount[0] != '/'))
+	{
+		mount.insert(mount.begin(), '/');
+	}
+	for (char &c : mount)
+	{
+		c = __LowerAscii(c);
+	}
+
+	m_mounts[mount] = provider;
+
+	// Mounts are only added while loading, so just rebuild the table.
+	m_routes.clear();
+	m_paths.clear();
+	m_providers.clear();
+
+	for (auto &it : m_mounts)
+	{
+		Route route;
+		route.m_offset = static_cast<uint32_t>(m_paths.size());
+		route.m_length = static_cast<uint32_t>(it.first.size());
+		route.m_provider = static_cast<uint32_t>(m_providers.size());
+
+		m_routes.push_back(route);
+		m_paths.insert(m_paths.end(), it.first.begin(), it.first.end());
+		m_providers.push_back(it.second);
+	}
+}
+
+
+const GatewayHost::Route *GatewayHost::findRoute(const char *path, size_t length) const
+{
+	// Same ordering as the std::map the table was built from.
+	auto compare = [this](const Route &route, const char *key, size_t keyLength) -> int
+	{
+		const char *routePath = m_paths.data() + route.m_offset;
+		size_t count = std::min<size_t>(route.m_length, keyLength);
+
+		for (size_t index = 0; index < count; ++index)
+		{
+			unsigned char left = static_cast<unsigned char>(routePath[index]);
+			unsigned char right = static_cast<unsigned char>(__LowerAscii(key[index]));
+			if (left != right)
+			{
+				return (left < right) ? -1 : 1;
+			}
+		}
+
+		return (route.m_length < keyLength) ? -1 : ((route.m_length > keyLength) ? 1 : 0);
+	};
+
+	size_t low = 0;
+	size_t high = m_routes.size();
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+
+		int result = compare(m_routes[middle], path, length);
+		if (result == 0)
+		{
+			return &m_routes[middle];
+		}
+
+		if (result < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return nullptr;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayHostMap
+//
+
+GatewayHostPtr GatewayHostMap::lookup(const char *hostName) const
+{
+	return lookup(hostName, strlen(hostName));
+}
+
+GatewayHostPtr GatewayHostMap::lookup(const char *hostName, size_t length) const
+{
+	uint32_t index = m_names.lookup(hostName, length);
+	if (index != NameTable::NOT_FOUND)
+	{
+		return m_hosts[index];
+	}
+
+	// Longest wildcard suffix wins; "*.example.com" also covers "example.com"
+	// and a bare "*" covers everything.
+	for (size_t pos = 0; pos < length; ++pos)
+	{
+		if ((pos == 0) || (hostName[pos - 1] == '.'))
+		{
+			index = m_wildcards.lookup(hostName + pos, length - pos);
+			if (index != NameTable::NOT_FOUND)
+			{
+				return m_hosts[index];
+			}
+		}
+	}
+
+	index = m_wildcards.lookup(hostName, 0);
+	return (index != NameTable::NOT_FOUND) ? m_hosts[index] : nullptr;
+}
+
+bool GatewayHostMap::insert(String hostName, GatewayHost *host)
+{
+	if (hostName.trim().isEmpty())
+	{
+		return true;
+	}
+
+	uint32_t index = static_cast<uint32_t>(m_hosts.size());
+
+	bool inserted;
+	if (hostName[0] == '*')
+	{
+		// Handle wildcard.
+		hostName.trimLeft('*');
+		hostName.trimLeft('.');
+
+		inserted = m_wildcards.insert(hostName, hostName.getLength(), index);
+	}
+	else
+	{
+		inserted = m_names.insert(hostName, hostName.getLength(), index);
+	}
+
+	if (inserted)
+	{
+		m_hosts.push_back(host);
+	}
+
+	return inserted;
+}
+
+void GatewayHostMap::compile()
+{
+	m_names.compile();
+	m_wildcards.compile();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayHostMap::NameTable
+//
+
+bool GatewayHostMap::NameTable::insert(const char *name, size_t length, uint32_t value)
+{
+	std::string key(name, length);
+	for (char &c : key)
+	{
+		c = __LowerAscii(c);
+	}
+
+	return m_pending.emplace(std::move(key), value).second;
+}
+
+void GatewayHostMap::NameTable::compile()
+{
+	std::vector<Key> keys;
+	keys.reserve(m_pending.size());
+
+	m_names.clear();
+	for (auto &it : m_pending)
+	{
+		Key key;
+		key.m_hash = Hash(it.first.data(), it.first.size());
+		key.m_offset = static_cast<uint32_t>(m_names.size());
+		key.m_length = static_cast<uint32_t>(it.first.size());
+		key.m_value = it.second;
+		keys.push_back(key);
+
+		m_names.insert(m_names.end(), it.first.begin(), it.first.end());
+	}
+
+	// Aim for a load factor of about 0.8; grow on the rare failure to place.
+	size_t slotCount = 1;
+	while (slotCount < (keys.size() + (keys.size() / 4)))
+	{
+		slotCount <<= 1;
+	}
+
+	while (!place(keys, slotCount))
+	{
+		slotCount <<= 1;
+	}
+
+	m_pending.clear();
+}
+
+
+uint32_t GatewayHostMap::NameTable::lookup(const char *name, size_t length) const
+{
+	if (m_slots.empty())
+	{
+		return NOT_FOUND;
+	}
+
+	uint64_t hash = Hash(name, length);
+	const Slot &slot = m_slots[GetSlot(hash, m_seeds[hash % m_seeds.size()], m_slotMask)];
+
+	if ((slot.m_value == NOT_FOUND) || (slot.m_length != length))
+	{
+		return NOT_FOUND;
+	}
+
+	const char *slotName = m_names.data() + slot.m_offset;
+	for (size_t index = 0; index < length; ++index)
+	{
+		if (__LowerAscii(name[index]) != slotName[index])
+		{
+			return NOT_FOUND;
+		}
+	}
+
+	return slot.m_value;
+}
+
+
+bool GatewayHostMap::NameTable::place(const std::vector<Key> &keys, size_t slotCount)
+{
+	static const uint32_t MAX_SEED = 65536;
+
+	// Hash and displace: bucket the keys, then find a seed per bucket that
+	// drops all of its keys into free slots, largest buckets first.
+	size_t bucketCount = std::max<size_t>(keys.size() / 4, 1);
+
+	std::vector<std::vector<const Key *>> buckets(bucketCount);
+	for (const Key &key : keys)
+	{
+		buckets[key.m_hash % bucketCount].push_back(&key);
+	}
+
+	std::vector<size_t> order(bucketCount);
+	for (size_t index = 0; index < bucketCount; ++index)
+	{
+		order[index] = index;
+	}
+	std::sort(
+		order.begin(), order.end(),
+		[&buckets](size_t left, size_t right)
+		{
+			return buckets[left].size() > buckets[right].size();
+		}
+	);
+
+	m_seeds.assign(bucketCount, 0);
+	m_slots.assign(slotCount, Slot());
+	m_slotMask = slotCount - 1;
+
+	std::vector<size_t> taken;
+	for (size_t bucketIndex : order)
+	{
+		const std::vector<const Key *> &bucket = buckets[bucketIndex];
+		if (bucket.empty())
+		{
+			break;
+		}
+
+		uint32_t seed = 0;
+		for (; seed < MAX_SEED; ++seed)
+		{
+			taken.clear();
+			for (const Key *key : bucket)
+			{
+				size_t slot = GetSlot(key->m_hash, seed, m_slotMask);
+				if ((m_slots[slot].m_value != NOT_FOUND) || (std::find(taken.begin(), taken.end(), slot) != taken.end()))
+				{
+					break;
+				}
+				taken.push_back(slot);
+			}
+
+			if (taken.size() == bucket.size())
+			{
+				break;
+			}
+		}
+
+		if (seed == MAX_SEED)
+		{
+			return false;
+		}
+
+		m_seeds[bucketIndex] = seed;
+		for (size_t index = 0; index < bucket.size(); ++index)
+		{
+			Slot &slot = m_slots[taken[index]];
+			slot.m_offset = bucket[index]->m_offset;
+			slot.m_length = bucket[index]->m_length;
+			slot.m_value = bucket[index]->m_value;
+		}
+	}
+
+	return true;
+}
+
+
+uint64_t GatewayHostMap::NameTable::Hash(const char *name, size_t length)
+{
+	// FNV-1a over the lower-cased name.
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t index = 0; index < length; ++index)
+	{
+		hash = (hash ^ static_cast<unsigned char>(__LowerAscii(name[index]))) * 1099511628211ull;
+	}
+	return hash;
+}
+
+size_t GatewayHostMap::NameTable::GetSlot(uint64_t hash, uint32_t seed, size_t slotMask)
+{
+	uint64_t mixed = hash ^ (seed * 0x9E3779B97F4A7C15ull);
+	mixed ^= mixed >> 33;
+	mixed *= 0xFF51AFD7ED558CCDull;
+	mixed ^= mixed >> 33;
+	return static_cast<size_t>(mixed) & slotMask;
+}
@@ -6,21 +6,42 @@
 //////////////////////////////////////////////////////////////////////////
 // class GatewayHost
 //
+// Provider mounts are kept in a flat table sorted by path, with the paths
+// packed into one buffer. A lookup picks the longest mount that equals the
+// request path or prefixes it at a '/', comparing case-insensitively.
+//
 
 class GatewayHost : public RefCounter
 {
 public:
-	GatewayHost();
+	GatewayHost(const String &name);
 	virtual ~GatewayHost();
 
+	const String &getName() const;
 	size_t getProviderCount() const;
 
-	GatewayProviderPtr lookupProvider(HttpUri &uri) const;
+	// The mount length splits the path; the rest is the provider's path info.
+	GatewayProviderPtr lookupProvider(const char *path, size_t length, size_t *mountLength = nullptr) const;
 
 	void addProvider(const char *path, GatewayProvider *provider);
 
 private:
-	HttpFolderIndex<GatewayProviderPtr> m_providers;
+	struct Route
+	{
+		uint32_t m_offset;
+		uint32_t m_length;
+		uint32_t m_provider;
+	};
+
+	String m_name;			// as configured, names separated by ';'
+
+	std::map<std::string, GatewayProviderPtr> m_mounts;
+
+	std::vector<Route> m_routes;
+	std::vector<char> m_paths;
+	std::vector<GatewayProviderPtr> m_providers;
+
+	const Route *findRoute(const char *path, size_t length) const;
 };
 
 typedef RefPointer<GatewayHost> GatewayHostPtr;
@@ -29,16 +50,66 @@ typedef RefPointer<GatewayHost> GatewayHostPtr;
 //////////////////////////////////////////////////////////////////////////
 // class GatewayHostMap
 //
+// Names are added while loading the host configuration and then compiled
+// into flat, read-only tables, so lookups never lock or allocate. Exact
+// names and wildcard suffixes each get a perfect hash table, so a probe
+// touches one slot; a wildcard lookup probes the name's label suffixes,
+// longest first.
+//
 
 class GatewayHostMap : public RefCounter
 {
 public:
-	GatewayHostPtr lookup(const char *hostName);
-	void insert(String hostName, GatewayHost *host);
+	GatewayHostPtr lookup(const char *hostName) const;
+	GatewayHostPtr lookup(const char *hostName, size_t length) const;
+
+	// Returns false if the name is already assigned.
+	bool insert(String hostName, GatewayHost *host);
+	void compile();
 
 private:
-	SyncMutex m_hostMutex;
-	PathIndex<GatewayHostPtr> m_hosts;
+	class NameTable
+	{
+	public:
+		static const uint32_t NOT_FOUND = UINT32_MAX;
+
+		bool insert(const char *name, size_t length, uint32_t value);
+		void compile();
+
+		uint32_t lookup(const char *name, size_t length) const;
+
+	private:
+		struct Key
+		{
+			uint64_t m_hash;
+			uint32_t m_offset;
+			uint32_t m_length;
+			uint32_t m_value;
+		};
+
+		struct Slot
+		{
+			uint32_t m_offset{ 0 };
+			uint32_t m_length{ 0 };
+			uint32_t m_value{ NOT_FOUND };
+		};
+
+		std::unordered_map<std::string, uint32_t> m_pending;
+
+		std::vector<uint32_t> m_seeds;
+		std::vector<Slot> m_slots;
+		std::vector<char> m_names;
+		size_t m_slotMask{ 0 };
+
+		static uint64_t Hash(const char *name, size_t length);
+		static size_t GetSlot(uint64_t hash, uint32_t seed, size_t slotMask);
+
+		bool place(const std::vector<Key> &keys, size_t slotCount);
+	};
+
+	std::vector<GatewayHostPtr> m_hosts;
+	NameTable m_names;
+	NameTable m_wildcards;
 };
 
 typedef RefPointer<GatewayHostMap> GatewayHostMapPtr;
@@ -49,7 +120,8 @@ typedef RefPointer<GatewayHostMap> GatewayHostMapPtr;
 * Inline Implementations
 */
 
-inline GatewayHost::GatewayHost()
+inline GatewayHost::GatewayHost(const String &name) :
+	m_name(name)
 {
 }
 
@@ -57,80 +129,12 @@ inline GatewayHost::~GatewayHost()
 {
 }
 
-inline size_t GatewayHost::getProviderCount() const
+inline const String &GatewayHost::getName() const
 {
-	return m_providers.getCount();
+	return m_name;
 }
 
-inline GatewayProviderPtr GatewayHost::lookupProvider(HttpUri &uri) const
-{
-	GatewayProviderPtr provider;
-
-	if (!m_providers.lookup(uri, provider))
-	{
-		provider = nullptr;
-	}
-
-	return provider;
-}
-
-inline void GatewayHost::addProvider(const char *path, GatewayProvider *provider)
-{
-	m_providers.insert(path, provider);
-}
-
-
-
-inline GatewayHostPtr GatewayHostMap::lookup(const char *hostName)
-{
-	GatewayHostPtr host;
-
-	m_hostMutex.lockShared();
-	if (!m_hosts.lookup(hostName, host))
-	{
-		m_hostMutex.unlockShared();
-		m_hostMutex.lock();
-
-		if (!m_hosts.lookup(hostName, host))
-		{
-			// Detect wildcard.
-			String wildcard = hostName;
-			wildcard.reverse();
-
-			size_t endPos = -1;
-			if (!m_hosts.lookup(wildcard, host, &endPos)
-				|| ((endPos != -1)
-					&& (endPos != wildcard.getLength())
-					&& (wildcard[endPos] != '.')))
-			{
-				host = nullptr;
-			}
-
-			m_hosts.insert(hostName, host);
-		}
-
-		m_hostMutex.unlock();
-	}
-	else
-	{
-		m_hostMutex.unlockShared();
-	}
-
-	return host;
-}
-
-inline void GatewayHostMap::insert(String hostName, GatewayHost *host)
+inline size_t GatewayHost::getProviderCount() const
 {
-	if (!hostName.trim().isEmpty())
-	{
-		// Handle wildcard.
-		if (hostName[0] == '*')
-		{
-			hostName.trimLeft('*');
-			hostName.trimLeft('.').reverse();
-		}
-
-		SyncLock lock(m_hostMutex);
-		m_hosts.insert(hostName, host);
-	}
+	return m_routes.size();
 }
@@ -11,6 +11,11 @@ bool GatewayHostConfig::load(const Xml &configRoot)
 	try
 	{
 		traverse(configRoot, configRoot.getAttributes());
+
+		for (auto &it : m_hostMaps)
+		{
+			it.second->compile();
+		}
 	}
 	catch (Exception &x)
 	{
@@ -104,7 +109,7 @@ void GatewayHostConfig::loadHost(
 		throw Exception("missing host name");
 	}
 
-	GatewayHostPtr host = new GatewayHost;
+	GatewayHostPtr host = new GatewayHost(prop);
 
 	traverse(
 		hostConfig,
@@ -117,37 +122,55 @@ void GatewayHostConfig::loadHost(
 				throw Exception("missing uri");
 			}
 
+			String tagName = childConfig.getTagName();
+
+			// A server may name its targets in an upstream group instead.
 			String target = childConfig.getAttribute("target");
-			if (target.isEmpty())
+			Xml upstreamConfig;
+			if (target.isEmpty() && !((tagName.compareNoCase("server") == 0) && childConfig.findChild("upstream", upstreamConfig)))
 			{
 				throw Exception("missing target");
 			}
 
-			String tagName = childConfig.getTagName();
+			GatewayProviderPtr provider;
+
 			if (tagName.compareNoCase("redirect") == 0)
 			{
-				host->addProvider(uri, new GatewayRedirectProvider(host, childConfig, target));
+				provider = new GatewayRedirectProvider(host, childConfig, target);
 			}
 			else if (tagName.compareNoCase("file") == 0)
 			{
-				host->addProvider(uri, new GatewayFileProvider(host, childConfig, target));
+				provider = new GatewayFileProvider(host, childConfig, target);
+			}
+			else if (tagName.compareNoCase("metrics") == 0)
+			{
+				provider = new GatewayMetricsProvider(host, childConfig, target);
 			}
 			else if (tagName.compareNoCase("server") == 0)
 			{
-				host->addProvider(uri, new GatewayServerProvider(host, childConfig, target));
+				provider = new GatewayServerProvider(host, childConfig, target);
 			}
 			else if (tagName.compareNoCase("publisher") == 0)
 			{
-				host->addProvider(uri, new GatewayPublisherProvider(host, childConfig, target));
+				provider = new GatewayPublisherProvider(host, childConfig, target);
 			}
 			else if (tagName.compareNoCase("subscriber") == 0)
 			{
-				host->addProvider(uri, new GatewaySubscriberProvider(host, childConfig, target));
+				provider = new GatewaySubscriberProvider(host, childConfig, target);
 			}
 			else
 			{
 				throw Exception("unknown provider type: %s", tagName);
 			}
+
+			// Inherited, so it can be set per provider, host or listener group.
+			String dispatchMode;
+			if (childProps.get("dispatch", dispatchMode))
+			{
+				provider->setInlineDispatch(dispatchMode.compareNoCase("inline") == 0);
+			}
+
+			host->addProvider(uri, provider);
 		}
 	);
 
@@ -186,11 +209,7 @@ void GatewayHostConfig::loadHost(
 					hostMap = it->second;
 				}
 
-				if (!hostMap->lookup(name))
-				{
-					hostMap->insert(name, host);
-				}
-				else
+				if (!hostMap->insert(name, host))
 				{
 					throw Exception("host '%s' already assigned to '%s'", name, connectorString);
 				}
@@ -0,0 +1,121 @@
+#include "pch.h"
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetrics
+//
+
+SyncMutex GatewayMetrics::sm_mutex;
+std::map<size_t, GatewayMetrics::source_t> GatewayMetrics::sm_sources;
+size_t GatewayMetrics::sm_nextSourceId = 1;
+
+
+size_t GatewayMetrics::AddSource(source_t &&source)
+{
+	SyncLock lock(sm_mutex);
+
+	size_t sourceId = sm_nextSourceId++;
+	sm_sources.emplace(sourceId, std::move(source));
+
+	return sourceId;
+}
+
+void GatewayMetrics::RemoveSource(size_t sourceId)
+{
+	SyncLock lock(sm_mutex);
+	sm_sources.erase(sourceId);
+}
+
+
+String GatewayMetrics::Format()
+{
+	Writer writer;
+
+	SyncLock lock(sm_mutex);
+	for (auto &it : sm_sources)
+	{
+		it.second(writer);
+	}
+
+	return writer.getText();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetrics::Histogram
+//
+
+const uint64_t GatewayMetrics::Histogram::BUCKET_BOUNDS[BUCKET_COUNT] =
+{
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 250000
+};
+
+
+void GatewayMetrics::Histogram::record(std::chrono::steady_clock::duration elapsed)
+{
+	uint64_t micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+	size_t bucket = 0;
+	while ((bucket < BUCKET_COUNT) && (micros > BUCKET_BOUNDS[bucket]))
+	{
+		bucket++;
+	}
+
+	m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(micros, std::memory_order_relaxed);
+}
+
+void GatewayMetrics::Histogram::write(Writer &writer, const char *name, const char *labels) const
+{
+	String prefix = (labels && *labels) ? String("%s,", labels) : String();
+	String metric;
+	String bucketLabels;
+
+	metric.format("%s_bucket", name);
+
+	uint64_t count = 0;
+	for (size_t bucket = 0; bucket <= BUCKET_COUNT; ++bucket)
+	{
+		count += m_buckets[bucket].load(std::memory_order_relaxed);
+
+		if (bucket < BUCKET_COUNT)
+		{
+			bucketLabels.format("%sle=\"%llu\"", prefix, static_cast<unsigned long long>(BUCKET_BOUNDS[bucket]));
+		}
+		else
+		{
+			bucketLabels.format("%sle=\"+Inf\"", prefix);
+		}
+
+		writer.add(metric, count, bucketLabels);
+	}
+
+	metric.format("%s_sum", name);
+	writer.add(metric, m_sum.load(std::memory_order_relaxed), labels);
+
+	metric.format("%s_count", name);
+	writer.add(metric, count, labels);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetrics::Writer
+//
+
+void GatewayMetrics::Writer::add(const char *name, uint64_t value, const char *labels)
+{
+	String line;
+	if (labels && *labels)
+	{
+		line.format("%s{%s} %llu\n", name, labels, static_cast<unsigned long long>(value));
+	}
+	else
+	{
+		line.format("%s %llu\n", name, static_cast<unsigned long long>(value));
+	}
+
+	m_text += line;
+}
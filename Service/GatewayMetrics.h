@@ -0,0 +1,62 @@
+#pragma once
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetrics
+//
+// Registry of counter sources, rendered in the Prometheus text format by
+// the <metrics> provider.
+//
+
+class GatewayMetrics
+{
+public:
+	class Writer
+	{
+	public:
+		void add(const char *name, uint64_t value, const char *labels = nullptr);
+
+		const String &getText() const;
+
+	private:
+		String m_text;
+	};
+
+	// Cumulative latency buckets in microseconds, in the Prometheus layout.
+	class Histogram
+	{
+	public:
+		void record(std::chrono::steady_clock::duration elapsed);
+		void write(Writer &writer, const char *name, const char *labels) const;
+
+	private:
+		static const size_t BUCKET_COUNT = 12;
+		static const uint64_t BUCKET_BOUNDS[BUCKET_COUNT];
+
+		std::atomic<uint64_t> m_buckets[BUCKET_COUNT + 1]{};
+		std::atomic<uint64_t> m_sum{ 0 };
+	};
+
+	using source_t = std::function<void(Writer &writer)>;
+
+	static size_t AddSource(source_t &&source);
+	static void RemoveSource(size_t sourceId);
+
+	static String Format();
+
+private:
+	static SyncMutex sm_mutex;
+	static std::map<size_t, source_t> sm_sources;
+	static size_t sm_nextSourceId;
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline const String &GatewayMetrics::Writer::getText() const
+{
+	return m_text;
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayObjectPool
+//
+// Recycles the storage of one object type. Each thread keeps a small free
+// list; surplus blocks move to a shared list in batches, so objects freed
+// on I/O threads can be reused by the thread accepting connections.
+//
+
+template <class T>
+class GatewayObjectPool
+{
+public:
+	static void *Alloc(size_t size);
+	static void Free(void *object, size_t size);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer, const char *labels);
+
+private:
+	static const size_t THREAD_CACHE_COUNT = 64;
+	static const size_t BATCH_COUNT = 32;
+	static const size_t SHARED_COUNT = 4096;
+
+	class ThreadCache
+	{
+	public:
+		~ThreadCache();
+
+		std::vector<void *> m_freeList;
+	};
+
+	static SyncMutex sm_mutex;
+	static std::vector<void *> sm_freeList;
+	static thread_local ThreadCache st_threadCache;
+
+	static std::atomic<size_t> sm_pooledCount;
+	static std::atomic<size_t> sm_hitCount;
+	static std::atomic<size_t> sm_missCount;
+
+	static void Drain(std::vector<void *> &freeList, size_t keepCount);
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayPooledObject
+//
+// Routes a class's allocations through its GatewayObjectPool.
+//
+
+template <class T>
+class GatewayPooledObject
+{
+public:
+	static void *operator new(size_t size);
+	static void operator delete(void *object, size_t size);
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+template <class T> SyncMutex GatewayObjectPool<T>::sm_mutex;
+template <class T> std::vector<void *> GatewayObjectPool<T>::sm_freeList;
+template <class T> thread_local typename GatewayObjectPool<T>::ThreadCache GatewayObjectPool<T>::st_threadCache;
+
+template <class T> std::atomic<size_t> GatewayObjectPool<T>::sm_pooledCount{ 0 };
+template <class T> std::atomic<size_t> GatewayObjectPool<T>::sm_hitCount{ 0 };
+template <class T> std::atomic<size_t> GatewayObjectPool<T>::sm_missCount{ 0 };
+
+
+template <class T>
+inline void *GatewayObjectPool<T>::Alloc(size_t size)
+{
+	// Derived types have their own size; leave them to the heap.
+	if (size != sizeof(T))
+	{
+		return ::operator new(size);
+	}
+
+	std::vector<void *> &freeList = st_threadCache.m_freeList;
+
+	if (freeList.empty())
+	{
+		SyncLock lock(sm_mutex);
+
+		size_t count = (sm_freeList.size() < BATCH_COUNT) ? sm_freeList.size() : BATCH_COUNT;
+		freeList.insert(freeList.end(), sm_freeList.end() - count, sm_freeList.end());
+		sm_freeList.resize(sm_freeList.size() - count);
+	}
+
+	if (freeList.empty())
+	{
+		sm_missCount++;
+		return ::operator new(size);
+	}
+
+	void *object = freeList.back();
+	freeList.pop_back();
+
+	sm_pooledCount--;
+	sm_hitCount++;
+
+	return object;
+}
+
+template <class T>
+inline void GatewayObjectPool<T>::Free(void *object, size_t size)
+{
+	if (!object)
+	{
+		return;
+	}
+
+	if (size != sizeof(T))
+	{
+		::operator delete(object);
+		return;
+	}
+
+	std::vector<void *> &freeList = st_threadCache.m_freeList;
+
+	freeList.push_back(object);
+	sm_pooledCount++;
+
+	if (freeList.size() > THREAD_CACHE_COUNT)
+	{
+		Drain(freeList, THREAD_CACHE_COUNT - BATCH_COUNT);
+	}
+}
+
+template <class T>
+inline void GatewayObjectPool<T>::Drain(std::vector<void *> &freeList, size_t keepCount)
+{
+	SyncLock lock(sm_mutex);
+
+	for (size_t index = keepCount; index < freeList.size(); ++index)
+	{
+		if (sm_freeList.size() < SHARED_COUNT)
+		{
+			sm_freeList.push_back(freeList[index]);
+		}
+		else
+		{
+			::operator delete(freeList[index]);
+			sm_pooledCount--;
+		}
+	}
+
+	freeList.resize(keepCount);
+}
+
+template <class T>
+inline void GatewayObjectPool<T>::WriteMetrics(GatewayMetrics::Writer &writer, const char *labels)
+{
+	writer.add("gateway_object_pool_size", sm_pooledCount, labels);
+	writer.add("gateway_object_pool_hits", sm_hitCount, labels);
+	writer.add("gateway_object_pool_misses", sm_missCount, labels);
+}
+
+template <class T>
+inline GatewayObjectPool<T>::ThreadCache::~ThreadCache()
+{
+	if (!m_freeList.empty())
+	{
+		Drain(m_freeList, 0);
+	}
+}
+
+
+template <class T>
+inline void *GatewayPooledObject<T>::operator new(size_t size)
+{
+	return GatewayObjectPool<T>::Alloc(size);
+}
+
+template <class T>
+inline void GatewayPooledObject<T>::operator delete(void *object, size_t size)
+{
+	GatewayObjectPool<T>::Free(object, size);
+}
@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "GatewayOriginHealth.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayOriginHealth
+//
+
+GatewayOriginHealth::GatewayOriginHealth(const String &labels, const Options &options) :
+	m_labels(labels),
+	m_options(options)
+{
+}
+
+
+bool GatewayOriginHealth::isAvailable()
+{
+	SyncLock lock(m_mutex);
+	return m_probeHealthy && (clock_t::now() >= m_ejectedUntil);
+}
+
+unsigned GatewayOriginHealth::getRampPercent()
+{
+	if (!m_options.m_slowStart)
+	{
+		return 100;
+	}
+
+	SyncLock lock(m_mutex);
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock_t::now() - m_recovered).count();
+	auto period = static_cast<long long>(m_options.m_slowStart) * 1000;
+	if ((elapsed < 0) || (elapsed >= period))
+	{
+		return 100;
+	}
+
+	return std::max(10u, static_cast<unsigned>((elapsed * 100) / period));
+}
+
+
+void GatewayOriginHealth::recordResponse(uint64_t latency, bool failed)
+{
+	SyncLock lock(m_mutex);
+
+	if (failed || (m_options.m_slowResponse && (latency > (m_options.m_slowResponse * 1000ull))))
+	{
+		countFailure(clock_t::now());
+	}
+	else
+	{
+		m_failureStreak = 0;
+		m_ejectionStreak = 0;
+	}
+}
+
+void GatewayOriginHealth::recordFailure()
+{
+	SyncLock lock(m_mutex);
+	countFailure(clock_t::now());
+}
+
+void GatewayOriginHealth::recordProbe(bool passed)
+{
+	SyncLock lock(m_mutex);
+
+	if (!passed)
+	{
+		m_probeFailureCount++;
+	}
+
+	if (passed == m_probeHealthy)
+	{
+		m_probeStreak = 0;
+		return;
+	}
+
+	if (++m_probeStreak < (passed ? m_options.m_healthyThreshold : m_options.m_unhealthyThreshold))
+	{
+		return;
+	}
+
+	m_probeHealthy = passed;
+	m_probeStreak = 0;
+
+	if (passed)
+	{
+		m_recovered = std::max(clock_t::now(), m_ejectedUntil);
+		AfxLogInfo("Origin {%s} passed health checks", m_labels);
+	}
+	else
+	{
+		AfxLogWarning("Origin {%s} failed health checks", m_labels);
+	}
+}
+
+
+void GatewayOriginHealth::countFailure(clock_t::time_point now)
+{
+	// Requests that were under way when it was ejected don't count.
+	if (!m_options.m_maxFailures || (now < m_ejectedUntil))
+	{
+		return;
+	}
+
+	if (++m_failureStreak < m_options.m_maxFailures)
+	{
+		return;
+	}
+
+	unsigned doublings = (m_ejectionStreak < MAX_EJECTION_DOUBLINGS) ? m_ejectionStreak : MAX_EJECTION_DOUBLINGS;
+	unsigned ejectionTime = m_options.m_ejectionTime << doublings;
+
+	m_failureStreak = 0;
+	m_ejectionStreak++;
+	m_ejectedUntil = now + std::chrono::seconds(ejectionTime);
+	m_recovered = m_ejectedUntil;
+	m_ejectionCount++;
+
+	AfxLogWarning("Ejected origin {%s} for %u seconds after %u failed requests", m_labels, ejectionTime, m_options.m_maxFailures);
+}
+
+
+void GatewayOriginHealth::writeMetrics(GatewayMetrics::Writer &writer, const char *labels)
+{
+	writer.add("gateway_origin_available", isAvailable() ? 1 : 0, labels);
+	writer.add("gateway_origin_ejections", m_ejectionCount, labels);
+
+	if (m_options.m_probe != Probe::NONE)
+	{
+		writer.add("gateway_origin_probe_failures", m_probeFailureCount, labels);
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayOriginHealth
+//
+// Whether an origin should get requests. Active probes take it out of
+// rotation after a run of failed checks and bring it back after a run of
+// passed ones; passively, a run of failed or slow requests ejects it for a
+// while, longer each time it is ejected again. An origin coming back is
+// ramped up over the slow-start period instead of taking its full share at
+// once.
+//
+
+class GatewayOriginHealth
+{
+public:
+	enum class Probe
+	{
+		NONE,
+		TCP,			// connect
+		HTTP			// GET a path
+	};
+
+	struct Options
+	{
+		Probe m_probe{ Probe::NONE };
+		String m_probeUrl;					// HTTP probes; the path
+		unsigned m_probeInterval{ 5 };		// seconds
+		unsigned m_probeTimeout{ 2000 };	// milliseconds, once connected
+		unsigned m_healthyThreshold{ 1 };	// passed probes to come back
+		unsigned m_unhealthyThreshold{ 1 };	// failed probes to go out
+
+		unsigned m_maxFailures{ 0 };		// failed requests to eject; zero: never
+		unsigned m_slowResponse{ 0 };		// milliseconds; slower is failed; zero: never
+		unsigned m_ejectionTime{ 30 };		// seconds, doubled for each repeat
+		unsigned m_slowStart{ 0 };			// seconds
+	};
+
+	GatewayOriginHealth(const String &labels, const Options &options);
+
+	const Options &getOptions() const;
+
+	bool isAvailable();
+
+	// Share of its weight an available origin gets, from 10 to 100 percent.
+	unsigned getRampPercent();
+
+	void recordResponse(uint64_t latency, bool failed);
+	void recordFailure();
+	void recordProbe(bool passed);
+
+	void writeMetrics(GatewayMetrics::Writer &writer, const char *labels);
+
+private:
+	using clock_t = std::chrono::steady_clock;
+
+	// Ejections beyond this many in a row don't lengthen the next one.
+	static const unsigned MAX_EJECTION_DOUBLINGS = 5;
+
+	String m_labels;
+	Options m_options;
+
+	SyncMutex m_mutex;
+	bool m_probeHealthy{ true };
+	unsigned m_probeStreak{ 0 };			// probes agreeing against the state
+	unsigned m_failureStreak{ 0 };
+	unsigned m_ejectionStreak{ 0 };
+	clock_t::time_point m_ejectedUntil;
+	clock_t::time_point m_recovered;		// start of slow-start
+
+	std::atomic<uint64_t> m_ejectionCount{ 0 };
+	std::atomic<uint64_t> m_probeFailureCount{ 0 };
+
+	// Called locked.
+	void countFailure(clock_t::time_point now);
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline const GatewayOriginHealth::Options &GatewayOriginHealth::getOptions() const
+{
+	return m_options;
+}
@@ -2,10 +2,55 @@
 #include "GatewayContext.h"
 #include "GatewayDispatcher.h"
 #include "GatewayProvider.h"
+#include "GatewayMetrics.h"
+#include "GatewayBufferPool.h"
 
 
 static const String ELLIPSIS = "...";
 static const String QUERY_ELLIPSIS = "?...";
+static const String GET_METHOD = "GET";
+static const String HEAD_METHOD = "HEAD";
+static const String ACCEPT_ENCODING_HEADER = "Accept-Encoding";
+static const String VARY_HEADER = "Vary";
+static const String KEEP_ALIVE_HEADER = "Keep-Alive";
+static const String CLOSE_CONNECTION = "close";
+
+
+// Safe to send again after a failure that may have reached the origin.
+static inline bool __IsIdempotent(const String &method)
+{
+	return (method == GET_METHOD) || (method == HEAD_METHOD) || (method == "OPTIONS") || (method == "TRACE")
+		|| (method == "PUT") || (method == "DELETE");
+}
+
+// Leaves the value alone if the attribute is missing.
+static inline void __GetOption(const Xml &config, const char *name, unsigned &value)
+{
+	String option = config.getAttribute(name);
+	if (!option.isEmpty())
+	{
+		value = static_cast<unsigned>(StringToInt(option));
+	}
+}
+
+// Buffers come from the shared pool, so sizes outside its classes are rejected.
+static inline void __GetBufferSize(const Xml &config, const char *name, size_t &value)
+{
+	String option = config.getAttribute(name);
+	if (option.isEmpty())
+	{
+		return;
+	}
+
+	long long size = StringToInt64(option);
+	if ((size < static_cast<long long>(GatewayBufferPool::MIN_BUFFER_SIZE)) || (size > static_cast<long long>(GatewayBufferPool::MAX_BUFFER_SIZE)))
+	{
+		throw Exception(ERROR_BAD_ARGUMENTS, "invalid %s: %s (%u to %u bytes)", name, option,
+			static_cast<unsigned>(GatewayBufferPool::MIN_BUFFER_SIZE), static_cast<unsigned>(GatewayBufferPool::MAX_BUFFER_SIZE));
+	}
+
+	value = static_cast<size_t>(size);
+}
 
 
 //////////////////////////////////////////////////////////////////////////
@@ -44,10 +89,34 @@ GatewayProvider::GatewayProvider(GatewayHost *host, const Xml &providerConfig, c
 					String password = child.getAttribute("password");
 
 					m_basicAuthUsers[name] = password;
+					m_systemAuth |= password.isEmpty();
 				}
 			}
 		}
 	}
+
+	// Concurrency limits.
+	Xml bulkheadConfig;
+	if (providerConfig.findChild("bulkhead", bulkheadConfig))
+	{
+		String labels = getMetricLabels();
+
+		// Queued requests are shed after queue-timeout ms.
+		unsigned queueTimeout = GatewayBulkhead::DEFAULT_QUEUE_TIMEOUT;
+		String queueTimeoutValue = bulkheadConfig.getAttribute("queue-timeout");
+		if (!queueTimeoutValue.isEmpty())
+		{
+			queueTimeout = StringToInt(queueTimeoutValue);
+		}
+
+		m_bulkhead = new GatewayBulkhead(
+			labels,
+			StringToInt(bulkheadConfig.getAttribute("max-inflight")),
+			StringToInt(bulkheadConfig.getAttribute("max-queued")),
+			StringToInt(bulkheadConfig.getAttribute("threads")),
+			queueTimeout
+		);
+	}
 }
 
 
@@ -77,6 +146,17 @@ void GatewayProvider::beginDispatch(GatewayContext *context, const HttpUri &uri)
 	dispatchRequest(context, uri);
 }
 
+String GatewayProvider::getMetricLabels() const
+{
+	// A server with an upstream leaves the target label to its members.
+	String labels("host=\"%s\",uri=\"%s\"", m_host ? m_host->getName() : String(), m_uri);
+	if (!m_target.isEmpty())
+	{
+		labels += String(",target=\"%s\"", m_target);
+	}
+	return labels;
+}
+
 
 
 //////////////////////////////////////////////////////////////////////////
@@ -155,7 +235,7 @@ void GatewayRedirectProvider::dispatchRequest(GatewayContext *context, const Htt
 		}
 	}
 
-	HttpServerResponse *response = new HttpServerResponse;
+	HttpServerResponse *response = new GatewayServerResponse;
 
 	response->setStatus(HttpStatus::REDIRECT_KEEP_VERB);
 	response->setHeader(HttpHeader::LOCATION, location);
@@ -182,291 +262,1486 @@ GatewayFileProvider::GatewayFileProvider(GatewayHost *host, const Xml &config, c
 		m_defaultFile = options.getAttribute("def-file");
 		m_defaultExtension = options.getAttribute("def-ext");
 
-		if (!m_defaultExtension.isEmpty() && (m_defaultExtension[0] != '.'))
-		{
-			m_defaultExtension = "." + m_defaultExtension;
-		}
+		if (!m_defaultExtension.isEmpty() && (m_defaultExtension[0] != '.'))
+		{
+			m_defaultExtension = "." + m_defaultExtension;
+		}
+
+		Xml responseHeaders;
+		if (options.findChild("response-headers", responseHeaders))
+		{
+			for (auto current : responseHeaders)
+			{
+				String name = current.getTagName();
+				String value = current.getData();
+				m_responseHeaders[name] = value;
+			}
+		}
+
+		// Small files are kept in memory when a cache size is given, and
+		// up to missing-cache-size paths that were not found.
+		size_t cacheSize = StringToInt(options.getAttribute("cache-size"));
+		size_t maxMissing = StringToInt(options.getAttribute("missing-cache-size"));
+		if (cacheSize || maxMissing)
+		{
+			size_t maxFileSize = StringToInt(options.getAttribute("cache-file-size"));
+			String labels = getMetricLabels();
+
+			m_cache = new GatewayFileCache(
+				m_target,
+				m_responseHeaders,
+				labels,
+				cacheSize,
+				maxFileSize ? maxFileSize : DEFAULT_CACHE_FILE_SIZE,
+				maxMissing);
+		}
+
+		// Precompressed siblings (name.br, name.gz) are sent to clients that
+		// accept them; nothing is compressed here.
+		String precompressed = options.getAttribute("precompressed");
+		precompressed.replace(",", ";");
+		precompressed.splice(
+			";",
+			[this](const String &entry) mutable
+			{
+				String name = entry;
+				name.trim();
+
+				auto listed =
+					[&name](const Encoding &encoding)
+					{
+						return name == encoding.m_name;
+					};
+
+				if (name.isEmpty() || std::any_of(m_encodings.begin(), m_encodings.end(), listed))
+				{
+					return;
+				}
+				if (name == "br")
+				{
+					m_encodings.push_back({ "br", ".br" });
+				}
+				else if (name == "gzip")
+				{
+					m_encodings.push_back({ "gzip", ".gz" });
+				}
+				else
+				{
+					throw Exception("unknown precompressed encoding: %s", name);
+				}
+			}
+		);
+
+		// Files from this size up are sent by file transfers; 0 turns it off.
+		String transferFileSize = options.getAttribute("transfer-file-size");
+		if (!transferFileSize.isEmpty())
+		{
+			m_transferFileSize = StringToInt(transferFileSize);
+		}
+	}
+}
+
+bool GatewayFileProvider::canDispatchInline() const
+{
+	return false;
+}
+
+void GatewayFileProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
+{
+	String pathInfo = context->getPathInfo();
+	pathInfo.trimLeft('/');
+
+	bool readRequest = (context->request.getMethod() == GET_METHOD) || (context->request.getMethod() == HEAD_METHOD);
+
+	uint64_t generation = 0;
+	if (m_cache && readRequest && m_cache->isMissing(pathInfo, generation))
+	{
+		HttpServerResponse *response = new GatewayServerResponse;
+		response->setStatus(HttpStatus::NOT_FOUND);
+		syncConnectionType(context->request, *response);
+		context->sendResponse(response);
+		return;
+	}
+
+	if (sendFile(context, pathInfo))
+	{
+		return;
+	}
+
+	HttpServerResponse *response = new GatewayServerResponse;
+
+	HttpFileHandler::RetrieveFile(
+		context->request,
+		*response,
+		m_target,
+		pathInfo,
+		m_defaultFile.isEmpty() ? nullptr : m_defaultFile,
+		m_defaultExtension.isEmpty() ? nullptr : m_defaultExtension,
+		false);
+
+	syncConnectionType(context->request, *response);
+
+	if (m_cache && readRequest && (response->getStatusCode() == HttpStatus::NOT_FOUND))
+	{
+		m_cache->addMissing(pathInfo, generation);
+	}
+
+	if (response->succeeded())
+	{
+		if (!m_responseHeaders.isEmpty())
+		{
+			for (auto current : m_responseHeaders)
+			{
+				response->setHeader(current.first, current.second);
+			}
+		}
+
+		// Another client may have been sent a precompressed sibling.
+		if (!m_encodings.empty())
+		{
+			response->setHeader(VARY_HEADER, ACCEPT_ENCODING_HEADER);
+		}
+	}
+
+	context->sendResponse(response);
+}
+
+unsigned GatewayFileProvider::acceptedEncodings(const HttpRequest &request) const
+{
+	if (m_encodings.empty())
+	{
+		return 0;
+	}
+
+	String header = request.getHeader(ACCEPT_ENCODING_HEADER);
+	const char *cursor = header;
+	const char *end = cursor + header.getLength();
+
+	unsigned accepted = 0;
+	unsigned refused = 0;
+	bool any = false;
+
+	while (cursor < end)
+	{
+		while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t') || (*cursor == ',')))
+		{
+			cursor++;
+		}
+
+		const char *name = cursor;
+		while ((cursor < end) && (*cursor != ',') && (*cursor != ';') && (*cursor != ' ') && (*cursor != '\t'))
+		{
+			cursor++;
+		}
+		size_t length = cursor - name;
+
+		// Only a zero quality matters: it refuses the coding.
+		bool zero = false;
+		while ((cursor < end) && (*cursor != ','))
+		{
+			if (((end - cursor) >= 2) && ((cursor[0] == 'q') || (cursor[0] == 'Q')) && (cursor[1] == '='))
+			{
+				cursor += 2;
+				zero = (cursor < end) && (*cursor == '0');
+				while ((cursor < end) && ((*cursor == '0') || (*cursor == '.')))
+				{
+					cursor++;
+				}
+				zero = zero && ((cursor == end) || (*cursor < '1') || (*cursor > '9'));
+				continue;
+			}
+			cursor++;
+		}
+
+		if (length == 0)
+		{
+			continue;
+		}
+
+		if ((length == 1) && (*name == '*'))
+		{
+			any = !zero;
+			continue;
+		}
+
+		for (size_t i = 0; i < m_encodings.size(); i++)
+		{
+			const String &encoding = m_encodings[i].m_name;
+			if ((length == encoding.getLength()) && (_strnicmp(name, encoding, length) == 0))
+			{
+				(zero ? refused : accepted) |= 1u << i;
+			}
+		}
+	}
+
+	// "*" covers whatever is not named.
+	if (any)
+	{
+		accepted |= ((1u << m_encodings.size()) - 1) & ~refused;
+	}
+
+	return accepted & ~refused;
+}
+
+bool GatewayFileProvider::resolveFile(const String &pathInfo, unsigned acceptedEncodings, GatewayFileSource &source) const
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+	String file = pathInfo;
+	file.replace("\\", "/");
+
+	// Leave anything unusual to the file handler.
+	if (strchr(file, ':') || strstr(file, "//"))
+	{
+		return false;
+	}
+
+	bool dotSegment = false;
+	file.splice(
+		"/",
+		[&dotSegment](const String &segment) mutable
+		{
+			dotSegment |= (segment == ".") || (segment == "..");
+		}
+	);
+	if (dotSegment)
+	{
+		return false;
+	}
+
+	if (file.isEmpty() || (file[file.getLength() - 1] == '/'))
+	{
+		if (m_defaultFile.isEmpty())
+		{
+			return false;
+		}
+		file += m_defaultFile;
+	}
+
+	String fullName("%s\\%s", m_target, file);
+	fullName.replace("/", "\\");
+
+	if (!GetFileAttributesExW(GatewayFileTransfer::ToWidePath(fullName, fullName.getLength()).c_str(), GetFileExInfoStandard, &attributes)
+		|| (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		const char *slash = strrchr(file, '/');
+		if (m_defaultExtension.isEmpty() || strchr(slash ? slash : static_cast<const char *>(file), '.'))
+		{
+			return false;
+		}
+
+		file += m_defaultExtension;
+		fullName += m_defaultExtension;
+
+		if (!GetFileAttributesExW(GatewayFileTransfer::ToWidePath(fullName, fullName.getLength()).c_str(), GetFileExInfoStandard, &attributes)
+			|| (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			return false;
+		}
+	}
+
+	source.m_fileName = fullName;
+	source.m_relativeName = file;
+	source.m_sourceName = source.m_relativeName;
+	source.m_encoding = "";
+	source.m_size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	source.m_vary = !m_encodings.empty();
+
+	// The first accepted sibling that exists is sent instead.
+	for (size_t i = 0; i < m_encodings.size(); i++)
+	{
+		if (!(acceptedEncodings & (1u << i)))
+		{
+			continue;
+		}
+
+		const Encoding &encoding = m_encodings[i];
+		String siblingName = fullName + encoding.m_extension;
+
+		WIN32_FILE_ATTRIBUTE_DATA siblingAttributes;
+		if (GetFileAttributesExW(GatewayFileTransfer::ToWidePath(siblingName, siblingName.getLength()).c_str(), GetFileExInfoStandard, &siblingAttributes)
+			&& !(siblingAttributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			source.m_fileName = siblingName;
+			source.m_relativeName = file + encoding.m_extension;
+			source.m_encoding = encoding.m_name;
+			source.m_size = (static_cast<uint64_t>(siblingAttributes.nFileSizeHigh) << 32) | siblingAttributes.nFileSizeLow;
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool GatewayFileProvider::sendFile(GatewayContext *context, const String &pathInfo)
+{
+	static const String RANGE_HEADER = "Range";
+
+	HttpRequest &request = context->request;
+
+	// Anything but reads goes through the file handler.
+	bool headRequest = request.getMethod() == HEAD_METHOD;
+	if (!headRequest && (request.getMethod() != GET_METHOD))
+	{
+		return false;
+	}
+
+	String range = request.getHeader(RANGE_HEADER);
+
+	HttpServerResponse connection;
+	syncConnectionType(request, connection);
+	bool keepAlive = connection.isKeepAlive();
+
+	unsigned accepted = acceptedEncodings(request);
+
+	GatewayFileCache::EntryPtr entry;
+	if (m_cache && range.isEmpty())
+	{
+		entry = m_cache->lookup(pathInfo, accepted);
+	}
+
+	if (!entry)
+	{
+		GatewayFileSource source;
+		if (!resolveFile(pathInfo, accepted, source))
+		{
+			return false;
+		}
+
+		if (m_cache && range.isEmpty() && (source.m_size <= m_cache->getMaxFileSize()))
+		{
+			entry = m_cache->load(pathInfo, accepted, source);
+		}
+
+		if (!entry)
+		{
+			// The file handler knows nothing of encodings, so siblings are
+			// always sent by file transfers.
+			if (range.isEmpty() && source.m_encoding.isEmpty() && (!m_transferFileSize || (source.m_size < m_transferFileSize)))
+			{
+				return false;
+			}
+
+			return sendFileTransfer(context, source, range, headRequest, keepAlive);
+		}
+	}
+
+	bool notModified = entry->isNotModified(request);
+	context->sendRawResponse(entry->buildHead(notModified, keepAlive), (notModified || headRequest) ? String() : entry->m_body, keepAlive);
+	return true;
+}
+
+bool GatewayFileProvider::sendFileTransfer(
+	GatewayContext *context,
+	const GatewayFileSource &source,
+	const String &range,
+	bool headRequest,
+	bool keepAlive)
+{
+	static const String IF_RANGE_HEADER = "If-Range";
+
+	HttpRequest &request = context->request;
+
+	GatewayFileTransferPtr transfer = new GatewayFileTransfer(context, keepAlive);
+
+	uint64_t size;
+	FILETIME lastWriteTime;
+	if (!transfer->open(source.m_fileName, size, lastWriteTime))
+	{
+		return false;
+	}
+
+	String etag = GatewayFileTransfer::FormatETag(lastWriteTime, size, source.m_encoding);
+	String lastModified = GatewayFileTransfer::FormatHttpDate(lastWriteTime);
+	String contentType = GatewayFileTransfer::LookupContentType(source.m_sourceName);
+	String connectionHeader = keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+	String validators = GatewayFileTransfer::FormatValidators(etag, lastModified, source);
+
+	if (GatewayFileTransfer::IsNotModified(request, etag, lastModified))
+	{
+		context->sendRawResponse("HTTP/1.1 304 Not Modified\r\n" + validators + connectionHeader, String(), keepAlive);
+		return true;
+	}
+
+	// A stale If-Range validator asks for the whole file instead.
+	std::vector<GatewayFileTransfer::Range> ranges;
+	GatewayFileTransfer::RangeResult rangeResult = GatewayFileTransfer::RangeResult::NONE;
+	if (!range.isEmpty())
+	{
+		String ifRange = request.getHeader(IF_RANGE_HEADER);
+		if (ifRange.isEmpty() || (ifRange == etag) || (ifRange == lastModified))
+		{
+			rangeResult = GatewayFileTransfer::ParseRanges(range, size, ranges);
+		}
+	}
+
+	if (rangeResult == GatewayFileTransfer::RangeResult::UNSATISFIABLE)
+	{
+		String response(
+			"HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%llu\r\n"
+			"Content-Length: 0\r\n"
+			"%s",
+			static_cast<unsigned long long>(size),
+			connectionHeader);
+
+		context->sendRawResponse(response, String(), keepAlive);
+		return true;
+	}
+
+	String head;
+	if (rangeResult == GatewayFileTransfer::RangeResult::NONE)
+	{
+		head.format("HTTP/1.1 200 OK\r\nContent-Type: %s\r\n", contentType);
+		transfer->addSegment(String(), 0, size);
+	}
+	else if (ranges.size() == 1)
+	{
+		const GatewayFileTransfer::Range &only = ranges.front();
+
+		head.format(
+			"HTTP/1.1 206 Partial Content\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Range: bytes %llu-%llu/%llu\r\n",
+			contentType,
+			static_cast<unsigned long long>(only.m_first),
+			static_cast<unsigned long long>(only.m_last),
+			static_cast<unsigned long long>(size));
+
+		transfer->addSegment(String(), only.m_first, only.m_last - only.m_first + 1);
+	}
+	else
+	{
+		static std::atomic<uint64_t> boundaryCount{ 0 };
+
+		String boundary(
+			"gateway-%016llx-%llx",
+			static_cast<unsigned long long>(std::chrono::steady_clock::now().time_since_epoch().count()),
+			static_cast<unsigned long long>(boundaryCount++));
+
+		head.format(
+			"HTTP/1.1 206 Partial Content\r\n"
+			"Content-Type: multipart/byteranges; boundary=%s\r\n",
+			boundary);
+
+		for (const GatewayFileTransfer::Range &part : ranges)
+		{
+			String prefix(
+				"%s%s\r\n"
+				"Content-Type: %s\r\n"
+				"Content-Range: bytes %llu-%llu/%llu\r\n"
+				"\r\n",
+				(&part == &ranges.front()) ? "--" : "\r\n--",
+				boundary,
+				contentType,
+				static_cast<unsigned long long>(part.m_first),
+				static_cast<unsigned long long>(part.m_last),
+				static_cast<unsigned long long>(size));
+
+			transfer->addSegment(prefix, part.m_first, part.m_last - part.m_first + 1);
+		}
+
+		transfer->setTrailer(String("\r\n--%s--\r\n", boundary));
+	}
+
+	head += String(
+		"Content-Length: %llu\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"%s",
+		static_cast<unsigned long long>(transfer->getContentLength()),
+		validators);
+
+	for (auto current : m_responseHeaders)
+	{
+		head += String("%s: %s\r\n", current.first, current.second);
+	}
+
+	head += connectionHeader;
+
+	if (headRequest)
+	{
+		context->sendRawResponse(head, String(), keepAlive);
+		return true;
+	}
+
+	transfer->setHead(head);
+	transfer->send();
+	return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetricsProvider
+//
+
+GatewayMetricsProvider::GatewayMetricsProvider(GatewayHost *host, const Xml &config, const String &target) :
+	GatewayProvider(host, config, target)
+{
+	if (m_target.compareNoCase("prometheus") != 0)
+	{
+		throw Exception("unknown metrics format: %s", m_target);
+	}
+}
+
+void GatewayMetricsProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
+{
+	HttpServerResponse connection;
+	syncConnectionType(context->request, connection);
+	bool keepAlive = connection.isKeepAlive();
+
+	String content = GatewayMetrics::Format();
+
+	String head;
+	head.format(
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %u\r\n"
+		"Cache-Control: no-store\r\n"
+		"Connection: %s\r\n"
+		"\r\n",
+		static_cast<unsigned>(content.getLength()),
+		keepAlive ? "keep-alive" : "close");
+
+	context->sendRawResponse(head, (context->request.getMethod() != "HEAD") ? content : String(), keepAlive);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayServerProvider
+//
+
+SyncMutex GatewayServerProvider::sm_connectionPoolMapMutex;
+GatewayServerProvider::ConnectionPoolMap *GatewayServerProvider::sm_connectionPoolMap = nullptr;
+unsigned GatewayServerProvider::sm_connectionPoolSerial = 0;
+
+
+GatewayServerProvider::GatewayServerProvider()
+{
+	initConnectionPoolMap();
+}
+
+GatewayServerProvider::GatewayServerProvider(GatewayHost *host, const Xml &config, const String &target, bool initConnectionPool) :
+	GatewayProvider(host, config, target)
+{
+	initConnectionPoolMap();
+
+	m_streamBufferSize = GatewayStreamPump::MIN_BUFFER_SIZE;
+	m_relayBufferSize = GatewayContext::RELAY_BUFFER_SIZE;
+
+	Xml optionConfig;
+	if (config.findChild("options", optionConfig))
+	{
+		m_newHost = optionConfig.getAttribute("new-host");
+
+		String newUri = optionConfig.getAttribute("new-uri");
+		if (!newUri.isEmpty())
+		{
+			if (!newUri.splitLeft("?", &m_newPath, &m_newQuery))
+			{
+				m_newPath = newUri;
+			}
+
+			if (m_newPath[0] != '/')
+			{
+				throw Exception(ERROR_BAD_ARGUMENTS, "invalid uri: %s", newUri);
+			}
+		}
+
+		m_streamResponses = optionConfig.getAttribute("stream-response") == "true";
+		__GetBufferSize(optionConfig, "stream-buffer", m_streamBufferSize);
+
+		// Larger relay buffers mean fewer reads and writes per upgraded connection.
+		__GetBufferSize(optionConfig, "relay-buffer", m_relayBufferSize);
+	}
+
+	// Idle reverse connections of publishers are kept until the subscriber
+	// drops them.
+	GatewayConnectionPool::Options poolOptions;
+	poolOptions.m_idleTimeout = initConnectionPool ? DEFAULT_IDLE_TIMEOUT : 0;
+	poolOptions.m_queueTimeout = DEFAULT_QUEUE_TIMEOUT;
+
+	Xml poolConfig;
+	if (config.findChild("pool", poolConfig))
+	{
+		String idleTimeout = poolConfig.getAttribute("idle-timeout");
+		if (!idleTimeout.isEmpty())
+		{
+			poolOptions.m_idleTimeout = StringToInt(idleTimeout);
+		}
+
+		poolOptions.m_minIdle = StringToInt(poolConfig.getAttribute("min-idle"));
+		poolOptions.m_maxIdle = StringToInt(poolConfig.getAttribute("max-idle"));
+		poolOptions.m_maxLifetime = StringToInt(poolConfig.getAttribute("max-lifetime"));
+		poolOptions.m_maxRequests = StringToInt(poolConfig.getAttribute("max-requests"));
+
+		// Requests beyond max-connections wait up to queue-timeout ms.
+		poolOptions.m_maxConnections = StringToInt(poolConfig.getAttribute("max-connections"));
+
+		String queueTimeout = poolConfig.getAttribute("queue-timeout");
+		if (!queueTimeout.isEmpty())
+		{
+			poolOptions.m_queueTimeout = StringToInt(queueTimeout);
+		}
+	}
+
+	// Health checks apply to each origin of the pools created here.
+	Xml healthConfig;
+	if (config.findChild("health", healthConfig))
+	{
+		GatewayOriginHealth::Options &healthOptions = poolOptions.m_health;
+
+		String probe = healthConfig.getAttribute("probe");
+		if (probe.compareNoCase("http") == 0)
+		{
+			healthOptions.m_probe = GatewayOriginHealth::Probe::HTTP;
+			String path = healthConfig.getAttribute("path");
+			healthOptions.m_probeUrl = (path[0] == '/') ? path : "/" + path;
+		}
+		else if (probe.compareNoCase("tcp") == 0)
+		{
+			healthOptions.m_probe = GatewayOriginHealth::Probe::TCP;
+		}
+		else if (!probe.isEmpty())
+		{
+			throw Exception(ERROR_BAD_ARGUMENTS, "unknown health probe: %s", probe);
+		}
+
+		__GetOption(healthConfig, "interval", healthOptions.m_probeInterval);
+		__GetOption(healthConfig, "timeout", healthOptions.m_probeTimeout);
+		__GetOption(healthConfig, "healthy-threshold", healthOptions.m_healthyThreshold);
+		__GetOption(healthConfig, "unhealthy-threshold", healthOptions.m_unhealthyThreshold);
+		__GetOption(healthConfig, "max-failures", healthOptions.m_maxFailures);
+		__GetOption(healthConfig, "slow-response", healthOptions.m_slowResponse);
+		__GetOption(healthConfig, "ejection-time", healthOptions.m_ejectionTime);
+		__GetOption(healthConfig, "slow-start", healthOptions.m_slowStart);
+	}
+
+	Xml upstreamConfig;
+	if (initConnectionPool && config.findChild("upstream", upstreamConfig))
+	{
+		initUpstream(upstreamConfig, poolOptions);
+	}
+	else if (m_target)
+	{
+		m_connectionPool = AcquireConnectionPool(m_target, poolOptions, initConnectionPool);
+	}
+
+	// Retries and hedges share a budget of extra requests.
+	Xml retryConfig;
+	if (config.findChild("retry", retryConfig))
+	{
+		unsigned budget = DEFAULT_RETRY_BUDGET;
+		unsigned minPerSecond = DEFAULT_MIN_RETRIES;
+
+		m_maxRetries = DEFAULT_MAX_RETRIES;
+		__GetOption(retryConfig, "max-retries", m_maxRetries);
+		__GetOption(retryConfig, "budget", budget);
+		__GetOption(retryConfig, "min-per-second", minPerSecond);
+
+		// Hedges fire after the 95th percentile of recent response times.
+		m_hedge = retryConfig.getAttribute("hedge") == "true";
+
+		m_retryBudget = new GatewayRetryBudget(getMetricLabels(), budget, minPerSecond);
+	}
+}
+
+void GatewayServerProvider::initUpstream(const Xml &upstreamConfig, const GatewayConnectionPool::Options &poolOptions)
+{
+	GatewayUpstream::Policy policy;
+	String balance = upstreamConfig.getAttribute("balance");
+	if (!GatewayUpstream::ParsePolicy(balance, policy))
+	{
+		throw Exception(ERROR_BAD_ARGUMENTS, "unknown balance policy: %s", balance);
+	}
+
+	// Hashing is on a header, a cookie or else the client address.
+	GatewayUpstream::HashSource hashSource = GatewayUpstream::HashSource::CLIENT_ADDRESS;
+	String hashName;
+	if (!(hashName = upstreamConfig.getAttribute("hash-header")).isEmpty())
+	{
+		hashSource = GatewayUpstream::HashSource::HEADER;
+	}
+	else if (!(hashName = upstreamConfig.getAttribute("hash-cookie")).isEmpty())
+	{
+		hashSource = GatewayUpstream::HashSource::COOKIE;
+	}
+
+	m_upstream = new GatewayUpstream(getMetricLabels(), policy, hashSource, hashName);
+
+	for (auto memberConfig : upstreamConfig)
+	{
+		if (memberConfig.getTagName() != "member")
+		{
+			continue;
+		}
+
+		String target = memberConfig.getAttribute("target");
+		if (target.isEmpty())
+		{
+			throw Exception("missing upstream member target");
+		}
+
+		// Each unit of weight adds points to the hash ring.
+		String weightValue = memberConfig.getAttribute("weight");
+		int weight = weightValue.isEmpty() ? 1 : StringToInt(weightValue);
+		if ((weight < 1) || (weight > static_cast<int>(GatewayUpstream::MAX_WEIGHT)))
+		{
+			throw Exception(ERROR_BAD_ARGUMENTS, "upstream member weight out of range: %s", weightValue);
+		}
+
+		ConnectionPool *pool = AcquireConnectionPool(target, poolOptions);
+		m_memberPools.push_back(pool);
+		m_upstream->addMember(target, weight, pool);
+	}
+
+	if (m_upstream->getMemberCount() == 0)
+	{
+		throw Exception("upstream without members");
+	}
+}
+
+void GatewayServerProvider::initConnectionPoolMap()
+{
+	SyncLock lock(sm_connectionPoolMapMutex);
+	if (!sm_connectionPoolMap)
+	{
+		sm_connectionPoolMap = new ConnectionPoolMap;
+	}
+
+	sm_connectionPoolMap->__incRef();
+}
+
+
+GatewayServerProvider::~GatewayServerProvider()
+{
+	if (m_connectionPool)
+	{
+		ReleaseConnectionPool(m_connectionPool);
+	}
+
+	for (ConnectionPool *pool : m_memberPools)
+	{
+		ReleaseConnectionPool(pool);
+	}
+
+	SyncLock lock(sm_connectionPoolMapMutex);
+	if (sm_connectionPoolMap && !sm_connectionPoolMap->__decRef())
+	{
+		sm_connectionPoolMap = nullptr;
+	}
+}
+
+void GatewayServerProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
+{
+	// Add the Forwarded header.
+	String fwdHost = context->request.getHost();
+
+	String forwarded("%s;host=%s;proto=%s", context->getForwardedPeers(), fwdHost, context->getStream()->isSecure() ? Http::SECURE_SCHEME : Http::SCHEME);
+	context->request.addHeader(HttpHeader::FORWARDED, forwarded);
+
+	// Apply options.
+	if (!m_newHost.isEmpty())
+	{
+		context->request.setHost(m_newHost);
+	}
+
+	bool isNewUri = !m_newPath.isEmpty() || !m_newQuery.isEmpty();
+	if (isNewUri)
+	{
+		HttpUri newUri;
+		if (m_newPath.isEmpty())
+		{
+			newUri.setPath(uri.getPath());
+		}
+		else
+		{
+			String path = m_newPath;
+			path.replace(ELLIPSIS, context->getPathInfo());	// Don't use full path; skip server-info.
+			newUri.setPath(path);
+		}
+
+		if (!m_newQuery.isEmpty())
+		{
+			String query = m_newQuery;
+			query.replace(ELLIPSIS, uri.getQueryString());
+			newUri.setQueryString(query);
+		}
+
+		context->request.setUri(newUri);
+	}
+
+	// Streamed requests are forwarded from their parsed head.
+	if (context->isStreamingRequest())
+	{
+		GatewayMessageHead &head = context->getRequestHead();
+
+		head.addHeader(HttpHeader::FORWARDED, forwarded);
+
+		if (!m_newHost.isEmpty())
+		{
+			head.setHeader(HttpHeader::HOST, m_newHost);
+		}
+
+		if (isNewUri)
+		{
+			head.setUri(context->request.getUri());
+		}
+	}
+
+	forwardRequest(context, 0);
+}
+
+void GatewayServerProvider::forwardRequest(GatewayContext *context, unsigned attempt)
+{
+	if (m_retryBudget && (attempt == 0))
+	{
+		m_retryBudget->deposit();
+	}
+
+	// Allocate stream to origin server.
+	NetStreamPtr serverStream;
+	ConnectionPool::Ptr pool;
+	if (!allocateConnection(context, serverStream, pool, attempt))
+	{
+		return;
+	}
+
+	if (!serverStream)
+	{
+		failRequest(context, attempt, true);
+		return;
+	}
+
+	sendToServer(context, serverStream, pool, attempt);
+}
+
+void GatewayServerProvider::failRequest(GatewayContext *context, unsigned attempt, bool replayable)
+{
+	// A fresh attempt picks a pool and connection again, so a stale pooled
+	// connection or an ejected member is not tried twice.
+	if (replayable && (attempt < m_maxRetries) && m_retryBudget->withdraw(false))
+	{
+		GatewayProviderPtr self = this;
+
+		context->post(
+			[this, self, context, attempt]() mutable
+			{
+				forwardRequest(context, attempt + 1);
+			}
+		);
+		return;
+	}
+
+	context->sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "host unavailable");
+}
+
+bool GatewayServerProvider::isReplayable(GatewayContext *context) const
+{
+	// The origin may have seen it, and a streamed body is gone once sent.
+	return __IsIdempotent(context->request.getMethod()) && !context->isStreamingRequest();
+}
+
+void GatewayServerProvider::sendToServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt)
+{
+	// Use a ref-pointer to ensure that the pool remains valid throughout async i/o routines.
+	// Otherwise, it may be prematurely deleted during configuration changes and crash when
+	// pool->free() is called.
+	ConnectionPool::Ptr poolRef = pool;
+	if (!poolRef)
+	{
+		poolRef = m_connectionPool;
+	}
+
+	if (context->isStreamingRequest())
+	{
+		streamToServer(context, serverStream, poolRef, attempt);
+		return;
+	}
+
+	context->sendRequest(
+		serverStream,
+		[this, poolRef, context, serverStream, attempt](IoState *state) mutable
+		{
+			if (state->succeeded())
+			{
+				receiveFromServer(context, serverStream, poolRef, attempt);
+			}
+			else
+			{
+				poolRef->getHealth().recordFailure();
+				poolRef->discard(serverStream);
+				failRequest(context, attempt, isReplayable(context));
+				state->setErrorCode(ERROR_SUCCESS);
+			}
+		}
+	);
+}
+
+void GatewayServerProvider::streamToServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt)
+{
+	ConnectionPool::Ptr poolRef = pool;
+
+	// Send the head right away; the body follows without being buffered.
+	context->sendRequestHead(
+		serverStream,
+		[this, poolRef, context, serverStream, attempt](bool succeeded) mutable
+		{
+			if (!succeeded)
+			{
+				// The body has not been read from the client yet.
+				poolRef->getHealth().recordFailure();
+				poolRef->discard(serverStream);
+				failRequest(context, attempt, __IsIdempotent(context->request.getMethod()));
+			}
+			else if (context->isExpectingContinue())
+			{
+				// The body is forwarded once the origin answers 100-continue, or
+				// has not answered in time.
+				context->expectContinue(serverStream);
+				streamFromServer(context, serverStream, poolRef, attempt);
+			}
+			else
+			{
+				context->sendRequestBody(
+					serverStream,
+					[this, poolRef, context, serverStream, attempt](bool succeeded) mutable
+					{
+						if (succeeded)
+						{
+							receiveFromServer(context, serverStream, poolRef, attempt);
+						}
+						else
+						{
+							poolRef->getHealth().recordFailure();
+							poolRef->discard(serverStream);
+							failRequest(context, attempt, false);
+						}
+					}
+				);
+			}
+		}
+	);
+}
+
+void GatewayServerProvider::receiveFromServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt)
+{
+	ConnectionPool::Ptr poolRef = pool;
+
+	if (m_streamResponses)
+	{
+		// Relay origin server's response as it arrives.
+		streamFromServer(context, serverStream, poolRef, attempt);
+		return;
+	}
+
+	if (canHedge(context, poolRef))
+	{
+		receiveHedged(context, serverStream, poolRef, attempt);
+		return;
+	}
+
+	// Receive origin server's response.
+	HttpResponsePtr serverResponse = new GatewayResponse;
 
-		Xml responseHeaders;
-		if (options.findChild("response-headers", responseHeaders))
+	context->receiveResponse(
+		serverResponse,
+		serverStream,
+		[this, poolRef, context, serverStream, serverResponse, attempt](IoState *state) mutable
 		{
-			for (auto current : responseHeaders)
+			if (state->succeeded())
 			{
-				String name = current.getTagName();
-				String value = current.getData();
-				m_responseHeaders[name] = value;
+				relayResponse(context, serverStream, poolRef, serverResponse);
+			}
+			else
+			{
+				poolRef->getHealth().recordFailure();
+				poolRef->discard(serverStream);
+				failRequest(context, attempt, isReplayable(context));
+				state->setErrorCode(ERROR_SUCCESS);
 			}
 		}
-	}
+	);
 }
 
-void GatewayFileProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
+void GatewayServerProvider::relayResponse(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, HttpResponsePtr serverResponse)
 {
-	String pathInfo = uri.getPathInfo();
-	pathInfo.trimLeft('/');
-
-	HttpServerResponse *response = new HttpServerResponse;
-
-	HttpFileHandler::RetrieveFile(
-		context->request,
-		*response,
-		m_target,
-		pathInfo,
-		m_defaultFile.isEmpty() ? nullptr : m_defaultFile,
-		m_defaultExtension.isEmpty() ? nullptr : m_defaultExtension,
-		false);
+	ConnectionPool::Ptr poolRef = pool;
 
-	syncConnectionType(context->request, *response);
+	poolRef->recordResponse(serverStream, serverResponse->getStatusCode() >= HttpStatus::SERVER_ERROR);
 
-	if (response->succeeded())
+	// Only a requested upgrade may take the connection over.
+	bool isSwitch = (serverResponse->getStatusCode() == HttpStatus::SWITCH_PROTOCOLS);
+	if (isSwitch && !context->request.hasHeader(HttpHeader::UPGRADE))
 	{
-		if (!m_responseHeaders.isEmpty())
+		poolRef->discard(serverStream);
+		context->sendErrorResponse(HttpStatus::BAD_GATEWAY);
+		return;
+	}
+
+	// Send origin server's response to the client.
+	context->sendResponse(
+		serverResponse,
+		[this, poolRef, context, serverStream, serverResponse, isSwitch](IoState *state) mutable
 		{
-			for (auto current : m_responseHeaders)
+			if (state->succeeded())
 			{
-				response->setHeader(current.first, current.second);
+				// Any upgrade takes both connections over, not just websockets.
+				if (isSwitch)
+				{
+					// Still one of the origin's connections until the relay ends.
+					poolRef->relay(serverStream);
+					context->beginRelay(
+						serverStream,
+						m_relayBufferSize,
+						[poolRef, serverStream]() mutable
+						{
+							poolRef->discard(serverStream, false);
+						}
+					);
+				}
+				else if (serverResponse->hasHeader(HttpHeader::CONNECTION, CLOSE_CONNECTION))
+				{
+					poolRef->discard(serverStream);
+				}
+				else
+				{
+					freeConnection(serverStream, poolRef, GatewayConnectionPool::ParseKeepAliveTimeout(serverResponse->getHeader(KEEP_ALIVE_HEADER)));
+				}
+			}
+			else
+			{
+				poolRef->discard(serverStream);
 			}
 		}
-	}
-
-	context->sendResponse(response);
+	);
 }
 
+void GatewayServerProvider::streamFromServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt)
+{
+	ConnectionPool::Ptr poolRef = pool;
 
-//////////////////////////////////////////////////////////////////////////
-// class GatewayServerProvider
-//
+	context->streamResponse(
+		new GatewayStreamPump(m_streamBufferSize),
+		serverStream,
+		[this, poolRef, context, serverStream, attempt](GatewayStreamPump *pump, bool succeeded) mutable
+		{
+			const GatewayMessageHead &head = pump->getHead();
 
-SyncMutex GatewayServerProvider::sm_connectionPoolMapMutex;
-GatewayServerProvider::ConnectionPoolMap *GatewayServerProvider::sm_connectionPoolMap = nullptr;
+			if (succeeded)
+			{
+				poolRef->recordResponse(serverStream, head.getStatusCode() >= HttpStatus::SERVER_ERROR);
 
+				// Any upgrade takes both connections over, not just websockets.
+				if (head.getStatusCode() == HttpStatus::SWITCH_PROTOCOLS)
+				{
+					// Still one of the origin's connections until the relay ends.
+					poolRef->relay(serverStream);
+					context->beginRelay(
+						serverStream,
+						m_relayBufferSize,
+						[poolRef, serverStream]() mutable
+						{
+							poolRef->discard(serverStream, false);
+						}
+					);
+				}
+				// An origin that answered without reading the body can't be reused.
+				else if (pump->isKeepAlive() && !pump->hasPendingData() && !context->isRequestBodyPending())
+				{
+					freeConnection(serverStream, poolRef, GatewayConnectionPool::ParseKeepAliveTimeout(head.getHeader(KEEP_ALIVE_HEADER)));
+				}
+				else
+				{
+					poolRef->discard(serverStream);
+				}
+			}
+			else
+			{
+				poolRef->discard(serverStream);
 
-GatewayServerProvider::GatewayServerProvider()
+				if (!pump->isHeadSent())
+				{
+					poolRef->getHealth().recordFailure();
+					failRequest(context, attempt, isReplayable(context));
+				}
+			}
+		}
+	);
+}
+
+
+bool GatewayServerProvider::canHedge(GatewayContext *context, ConnectionPool *pool) const
 {
-	initConnectionPoolMap();
+	// Only a request held whole in its parsed head can be sent twice.
+	if (!m_hedge || !context->isRequestBuffered() || context->request.hasHeader(HttpHeader::UPGRADE))
+	{
+		return false;
+	}
+
+	String method = context->request.getMethod();
+	return ((method == GET_METHOD) || (method == HEAD_METHOD)) && pool->getTailLatency();
 }
 
-GatewayServerProvider::GatewayServerProvider(GatewayHost *host, const Xml &config, const String &target, bool initConnectionPool) :
-	GatewayProvider(host, config, target)
+void GatewayServerProvider::receiveHedged(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt)
 {
-	initConnectionPoolMap();
+	HedgedExchange::Ptr exchange = new HedgedExchange(context, attempt);
+	exchange->m_attempts[0].m_stream = serverStream;
+	exchange->m_attempts[0].m_pool = pool;
+	exchange->m_attempts[0].m_active = true;
+
+	// Taken now, while the request is still this context's current one.
+	exchange->m_hedgeHead = context->getRequestHead().format();
+	exchange->m_attempts[1].m_pool = m_upstream ? m_memberPools[m_upstream->select(context)] : m_connectionPool;
+
+	// Race a second request once this one is slower than 95% of recent ones.
+	unsigned delay = static_cast<unsigned>((pool->getTailLatency() + 999) / 1000);
+	GatewayProviderPtr self = this;
+
+	context->postAfter(
+		delay,
+		[this, self, exchange]() mutable
+		{
+			sendHedge(exchange);
+		}
+	);
 
-	Xml optionConfig;
-	if (config.findChild("options", optionConfig))
+	receiveAttempt(exchange, 0);
+}
+
+void GatewayServerProvider::sendHedge(HedgedExchange::Ptr exchange)
+{
 	{
-		m_newHost = optionConfig.getAttribute("new-host");
+		SyncLock lock(exchange->m_mutex);
 
-		String newUri = optionConfig.getAttribute("new-uri");
-		if (!newUri.isEmpty())
+		// Once answered or over, the context may be serving another request.
+		if ((exchange->m_winner >= 0) || !exchange->m_pending)
 		{
-			if (!newUri.splitLeft("?", &m_newPath, &m_newQuery))
-			{
-				m_newPath = newUri;
-			}
-
-			if (m_newPath[0] != '/')
-			{
-				throw Exception(ERROR_BAD_ARGUMENTS, "invalid uri: %s", newUri);
-			}
+			return;
 		}
+
+		// Holds the winner back until the hedge is done with the context.
+		exchange->m_pending++;
+		exchange->m_hedging = true;
 	}
 
-	if (m_target)
+	// Never waits for a connection; at the limit there is simply no hedge,
+	// and nothing is spent from the budget.
+	ConnectionPool::Ptr pool = exchange->m_attempts[1].m_pool;
+	NetStreamPtr serverStream = pool->alloc();
+
+	// Nothing was sent on it yet, so it can be reused.
+	if (serverStream && !m_retryBudget->withdraw(true))
 	{
-		m_connectionPool = AcquireConnectionPool(m_target, initConnectionPool);
+		pool->free(serverStream);
+		serverStream = nullptr;
 	}
-}
 
-void GatewayServerProvider::initConnectionPoolMap()
-{
-	SyncLock lock(sm_connectionPoolMapMutex);
-	if (!sm_connectionPoolMap)
+	if (!serverStream)
 	{
-		sm_connectionPoolMap = new ConnectionPoolMap;
+		endAttempt(exchange, 1, false);
+		return;
 	}
 
-	sm_connectionPoolMap->__incRef();
-}
-
+	bool answered;
+	{
+		SyncLock lock(exchange->m_mutex);
 
-GatewayServerProvider::~GatewayServerProvider()
-{
-	ReleaseConnectionPool(m_target);
+		answered = (exchange->m_winner >= 0);
+		if (!answered)
+		{
+			HedgedExchange::Attempt &hedge = exchange->m_attempts[1];
+			hedge.m_stream = serverStream;
+			hedge.m_active = true;
+		}
+	}
 
-	SyncLock lock(sm_connectionPoolMapMutex);
-	if (sm_connectionPoolMap && !sm_connectionPoolMap->__decRef())
+	if (answered)
 	{
-		sm_connectionPoolMap = nullptr;
+		pool->free(serverStream);
+		endAttempt(exchange, 1, false);
+		return;
 	}
+
+	serverStream->write(
+		static_cast<const char *>(exchange->m_hedgeHead),
+		exchange->m_hedgeHead.getLength(),
+		[this, exchange](IoState *state) mutable
+		{
+			if (state->succeeded())
+			{
+				receiveAttempt(exchange, 1);
+			}
+			else
+			{
+				state->setErrorCode(ERROR_SUCCESS);
+				endAttempt(exchange, 1, false);
+			}
+		}
+	);
 }
 
-void GatewayServerProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
+void GatewayServerProvider::receiveAttempt(HedgedExchange::Ptr exchange, size_t index)
 {
-	// Add the Forwarded header.
-	NetStreamPtr clientStream = context->getStream();
-	String fwdFor = clientStream->getRemoteAddress();
-	String fwdBy = clientStream->getLocalAddress();
-	String fwdHost = context->request.getHost();
-	String fwdProto = clientStream->isSecure() ? Http::SECURE_SCHEME : Http::SCHEME;
+	HedgedExchange::Attempt &attempt = exchange->m_attempts[index];
+	attempt.m_response = new GatewayResponse;
 
-	fwdFor.splitLeft(":", &fwdFor, nullptr);	// truncate port
-	fwdBy.splitLeft(":", &fwdBy, nullptr);		// truncate port
+	exchange->m_context->receiveHedgeResponse(
+		attempt.m_response,
+		attempt.m_stream,
+		[this, exchange, index](IoState *state) mutable
+		{
+			bool succeeded = state->succeeded();
+			state->setErrorCode(ERROR_SUCCESS);
+			endAttempt(exchange, index, succeeded);
+		}
+	);
 
-	context->request.addHeader(HttpHeader::FORWARDED, String("for=%s;by=%s;host=%s;proto=%s", fwdFor, fwdBy, fwdHost, fwdProto));
+	if (index == 0)
+	{
+		return;
+	}
 
-	// Apply options.
-	if (!m_newHost.isEmpty())
+	// The hedge's request is out, so a winner held back for it can go.
+	bool relay;
 	{
-		context->request.setHost(m_newHost);
+		SyncLock lock(exchange->m_mutex);
+
+		exchange->m_hedging = false;
+		relay = (exchange->m_winner >= 0) && !exchange->m_relayed;
+		exchange->m_relayed |= relay;
 	}
 
-	if (!m_newPath.isEmpty() || !m_newQuery.isEmpty())
+	if (relay)
 	{
-		HttpUri newUri;
-		if (m_newPath.isEmpty())
+		relayWinner(exchange);
+	}
+}
+
+void GatewayServerProvider::endAttempt(HedgedExchange::Ptr exchange, size_t index, bool succeeded)
+{
+	HedgedExchange::Attempt &attempt = exchange->m_attempts[index];
+	HedgedExchange::Attempt *loser = nullptr;
+	bool failed = false;
+	bool relay;
+	bool over;
+
+	{
+		SyncLock lock(exchange->m_mutex);
+
+		if (succeeded && (exchange->m_winner < 0))
 		{
-			newUri.setPath(uri.getPath());
+			exchange->m_winner = static_cast<int>(index);
+
+			HedgedExchange::Attempt &other = exchange->m_attempts[1 - index];
+			if (other.m_active)
+			{
+				other.m_cancelled = true;
+				loser = &other;
+			}
 		}
 		else
 		{
-			String path = m_newPath;
-			path.replace(ELLIPSIS, uri.getPathInfo());	// Don't use full path; skip server-info.
-			newUri.setPath(path);
+			// Failed by itself, rather than closed for losing.
+			failed = attempt.m_active && !attempt.m_cancelled;
 		}
 
-		if (!m_newQuery.isEmpty())
+		if (index == 1)
 		{
-			String query = m_newQuery;
-			query.replace(ELLIPSIS, uri.getQueryString());
-			newUri.setQueryString(query);
+			exchange->m_hedging = false;
 		}
 
-		context->request.setUri(newUri);
+		attempt.m_active = false;
+		over = (--exchange->m_pending == 0);
+
+		relay = (exchange->m_winner >= 0) && !exchange->m_relayed && !exchange->m_hedging;
+		exchange->m_relayed |= relay;
 	}
 
-	// Allocate stream to origin server.
-	NetStreamPtr serverStream;
-	if (!allocateConnection(context, serverStream))
+	// Closing fails the loser's pending i/o, which then only ends it here.
+	if (loser)
 	{
-		return;
+		loser->m_pool->discard(loser->m_stream);
 	}
 
-	if (!serverStream)
+	if (failed)
 	{
-		context->sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "host unavailable");
-		return;
+		attempt.m_pool->getHealth().recordFailure();
+		attempt.m_pool->discard(attempt.m_stream);
 	}
 
-	sendToServer(context, serverStream);
+	if (relay)
+	{
+		relayWinner(exchange);
+	}
+	else if (over && (exchange->m_winner < 0))
+	{
+		GatewayContext *context = exchange->m_context;
+
+		context->endHedgeResponses();
+		failRequest(context, exchange->m_attempt, isReplayable(context));
+	}
 }
 
-void GatewayServerProvider::sendToServer(GatewayContext *context, NetStreamPtr serverStream)
+void GatewayServerProvider::relayWinner(HedgedExchange::Ptr exchange)
 {
-	// Use a ref-pointer to ensure that the pool remains valid throughout async i/o routines.
-	// Otherwise, it may be prematurely deleted during configuration changes and crash when
-	// pool->free() is called.
-	ConnectionPool::Ptr pool = m_connectionPool;
+	GatewayContext *context = exchange->m_context;
 
-	context->sendRequest(
-		serverStream,
-		[this, pool, context, serverStream](IoState *state) mutable
+	if (exchange->m_winner == 1)
+	{
+		m_retryBudget->countHedgeWin();
+	}
+
+	// The loser may still be closing; the context is done with both.
+	context->endHedgeResponses();
+
+	HedgedExchange::Attempt &winner = exchange->m_attempts[exchange->m_winner];
+	relayResponse(context, winner.m_stream, winner.m_pool, winner.m_response);
+}
+
+bool GatewayServerProvider::allocateConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool::Ptr &pool, unsigned attempt)
+{
+	pool = m_upstream ? m_memberPools[m_upstream->select(context)] : m_connectionPool;
+
+	if (!context->isDispatchingInline())
+	{
+		return allocatePooledConnection(context, serverStream, pool, attempt);
+	}
+
+	// Inline, only reuse an idle connection; connecting may block, so that
+	// part moves to a worker thread.
+	serverStream = pool->alloc(false);
+	if (serverStream)
+	{
+		return true;
+	}
+
+	GatewayProviderPtr self = this;
+
+	context->post(
+		[this, self, context, pool, attempt]() mutable
 		{
-			if (state->succeeded())
+			NetStreamPtr serverStream;
+			if (!allocatePooledConnection(context, serverStream, pool, attempt))
 			{
-				// Receive origin server's response.
-				HttpResponsePtr serverResponse = new HttpResponse;
+				return;
+			}
 
-				context->receiveResponse(
-					serverResponse,
-					serverStream,
-					[this, pool, context, serverStream, serverResponse](IoState *state) mutable
-					{
-						if (state->succeeded())
-						{
-							// Send origin server's response to the client.
-							context->sendResponse(
-								serverResponse,
-								[this, pool, context, serverStream, serverResponse](IoState *state) mutable
-								{
-									if (state->succeeded())
-									{
-										// Detect websocket.
-										if ((serverResponse->getStatusCode() == HttpStatus::SWITCH_PROTOCOLS)
-											&& serverResponse->hasHeader(HttpHeader::UPGRADE, Http::WEBSOCKET)
-											&& serverResponse->hasHeader(HttpHeader::CONNECTION, Http::UPGRADE_CONNECTION))
-										{
-											context->beginRelay(serverStream);
-										}
-										else
-										{
-											freeConnection(serverStream, pool);
-										}
-									}
-									else
-									{
-										serverStream->close();
-									}
-								}
-							);
-						}
-						else
-						{
-							serverStream->close();
-							context->sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "host unavailable");
-							state->setErrorCode(ERROR_SUCCESS);
-						}
-					}
-				);
+			if (serverStream)
+			{
+				sendToServer(context, serverStream, pool, attempt);
 			}
 			else
 			{
-				serverStream->close();
-				context->sendErrorResponse(HttpStatus::SERVICE_UNAVAIL, "host unavailable");
-				state->setErrorCode(ERROR_SUCCESS);
+				failRequest(context, attempt, true);
 			}
 		}
 	);
+
+	return false;
 }
 
-bool GatewayServerProvider::allocateConnection(GatewayContext *context, NetStreamPtr &serverStream)
+bool GatewayServerProvider::allocatePooledConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool *pool, unsigned attempt)
 {
-	serverStream = m_connectionPool->alloc();
-	return true;
+	GatewayProviderPtr self = this;
+	ConnectionPool::Ptr poolRef = pool;
+
+	// At the connection limit, the request waits its turn for a connection.
+	return pool->alloc(
+		serverStream,
+		[this, self, context, poolRef, attempt](NetStreamPtr serverStream) mutable
+		{
+			context->post(
+				[this, self, context, poolRef, serverStream, attempt]() mutable
+				{
+					if (serverStream)
+					{
+						sendToServer(context, serverStream, poolRef, attempt);
+					}
+					else
+					{
+						failRequest(context, attempt, true);
+					}
+				}
+			);
+		}
+	);
 }
 
-void GatewayServerProvider::freeConnection(NetStreamPtr serverStream, ConnectionPool *pool)
+void GatewayServerProvider::freeConnection(NetStreamPtr serverStream, ConnectionPool *pool, unsigned keepAliveTimeout)
 {
 	if (!pool)
 	{
 		pool = m_connectionPool;
 	}
-	pool->free(serverStream);
+	pool->free(serverStream, keepAliveTimeout);
 }
 
 
 
-GatewayServerProvider::ConnectionPool *GatewayServerProvider::AcquireConnectionPool(const String &connector, bool init)
+static inline String __GetPoolKey(const String &connector, const GatewayConnectionPool::Options &options)
+{
+	const GatewayOriginHealth::Options &health = options.m_health;
+
+	return String(
+		"%s|%u,%u,%u,%u,%u,%u,%u|%d,%s,%u,%u,%u,%u,%u,%u,%u,%u",
+		connector,
+		static_cast<unsigned>(options.m_minIdle),
+		static_cast<unsigned>(options.m_maxIdle),
+		options.m_idleTimeout,
+		options.m_maxLifetime,
+		static_cast<unsigned>(options.m_maxRequests),
+		static_cast<unsigned>(options.m_maxConnections),
+		options.m_queueTimeout,
+		static_cast<int>(health.m_probe),
+		health.m_probeUrl,
+		health.m_probeInterval,
+		health.m_probeTimeout,
+		health.m_healthyThreshold,
+		health.m_unhealthyThreshold,
+		health.m_maxFailures,
+		health.m_slowResponse,
+		health.m_ejectionTime,
+		health.m_slowStart);
+}
+
+GatewayServerProvider::ConnectionPool *GatewayServerProvider::AcquireConnectionPool(const String &connector, const GatewayConnectionPool::Options &options, bool init)
 {
 	ConnectionPool *connectionPool = nullptr;
 	SyncLock lock(sm_connectionPoolMapMutex);
 
 	if (sm_connectionPoolMap)
 	{
-		auto it = sm_connectionPoolMap->find(connector);
+		String key = __GetPoolKey(connector, options);
+
+		auto it = sm_connectionPoolMap->find(key);
 		if (it != sm_connectionPoolMap->end())
 		{
 			connectionPool = it->second;
 		}
 		else
 		{
-			connectionPool = new ConnectionPool;
-			sm_connectionPoolMap->emplace(connector, connectionPool);
+			String scheme, address;
+			connector.splitLeft(":", &scheme, &address);
 
-			if (init)
+			// Limits are enforced per pool, so the origin may briefly see both
+			// while providers with the old options drain after a reload.
+			String labels("target=\"%s\"", connector);
+			for (auto &entry : *sm_connectionPoolMap)
 			{
-				String scheme, address;
-				connector.splitLeft(":", &scheme, &address);
+				if (entry.second->m_connector == connector)
+				{
+					AfxLogWarning("Connection pool options for %s differ from those of a pool in use; each keeps its own limits", connector);
+					labels.format("target=\"%s\",pool=\"%u\"", connector, ++sm_connectionPoolSerial);
+					break;
+				}
+			}
 
+			connectionPool = new ConnectionPool(labels, options, connector, key);
+			sm_connectionPoolMap->emplace(key, connectionPool);
+
+			if (init)
+			{
 				NetProtocol *protocol = NetProtocol::LookupScheme(scheme);
 				if (!protocol)
 				{
@@ -483,19 +1758,21 @@ GatewayServerProvider::ConnectionPool *GatewayServerProvider::AcquireConnectionP
 	return connectionPool;
 }
 
-bool GatewayServerProvider::ReleaseConnectionPool(const String &connector)
+bool GatewayServerProvider::ReleaseConnectionPool(ConnectionPool *pool)
 {
 	bool released = false;
 	SyncLock lock(sm_connectionPoolMapMutex);
 
 	if (sm_connectionPoolMap)
 	{
-		auto it = sm_connectionPoolMap->find(connector);
-		if (it != sm_connectionPoolMap->end())
+		auto it = sm_connectionPoolMap->find(pool->m_key);
+		if ((it != sm_connectionPoolMap->end()) && (it->second == pool))
 		{
 			released = (--(it->second->m_acquisitionCount) == 0);
 			if (released)
 			{
+				// Requests still under way keep it until they are done.
+				pool->stop();
 				sm_connectionPoolMap->erase(it);
 			}
 		}
@@ -526,9 +1803,10 @@ void GatewayPublisherProvider::dispatchRequest(GatewayContext *context, const Ht
 	__super::dispatchRequest(context, uri);
 }
 
-bool GatewayPublisherProvider::allocateConnection(GatewayContext *context, NetStreamPtr &serverStream)
+bool GatewayPublisherProvider::allocateConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool::Ptr &pool, unsigned attempt)
 {
-	serverStream = m_connectionPool->alloc(false);
+	pool = m_connectionPool;
+	serverStream = pool->alloc(false);
 	if (serverStream)
 	{
 		return true;
@@ -551,7 +1829,7 @@ bool GatewayPublisherProvider::allocateConnection(GatewayContext *context, NetSt
 	return false;
 }
 
-void GatewayPublisherProvider::freeConnection(NetStreamPtr serverStream, ConnectionPool *pool)
+void GatewayPublisherProvider::freeConnection(NetStreamPtr serverStream, ConnectionPool *pool, unsigned keepAliveTimeout)
 {
 	GatewayContext *pendingContext{ nullptr };
 
@@ -571,7 +1849,7 @@ void GatewayPublisherProvider::freeConnection(NetStreamPtr serverStream, Connect
 	}
 	else
 	{
-		__super::freeConnection(serverStream, pool);
+		__super::freeConnection(serverStream, pool, keepAliveTimeout);
 	}
 }
 
@@ -599,7 +1877,7 @@ void GatewayPublisherProvider::attachSubscriber(GatewayContext *subscriberContex
 
 	if (request.hasHeader(HttpHeader::UPGRADE, Http::WEBSOCKET))
 	{
-		HttpResponsePtr response = new HttpResponse;
+		HttpResponsePtr response = new GatewayResponse;
 
 		if (m_controllerContext)
 		{
@@ -692,7 +1970,7 @@ void GatewaySubscriberProvider::initDispatcher()
 		Dispatcher(GatewayHost *host) : m_host(host)
 		{
 		}
-		virtual GatewayHostPtr lookupHost(const char *hostName) override {
+		virtual GatewayHostPtr lookupHost(const char *hostName, size_t length) override {
 			return m_host;
 		}
 	};
@@ -760,6 +2038,12 @@ void GatewaySubscriberProvider::sendAttachRequest()
 }
 
 
+bool GatewaySubscriberProvider::canDispatchInline() const
+{
+	// Attaching to the publisher is synchronous.
+	return false;
+}
+
 void GatewaySubscriberProvider::dispatchRequest(GatewayContext *context, const HttpUri &uri)
 {
 }
@@ -1,4 +1,10 @@
 #pragma once
+#include "GatewayBulkhead.h"
+#include "GatewayConnectionPool.h"
+#include "GatewayFileCache.h"
+#include "GatewayFileTransfer.h"
+#include "GatewayRetryBudget.h"
+#include "GatewayUpstream.h"
 
 
 class GatewayHost;
@@ -19,10 +25,17 @@ public:
 
 	GatewayHost *getHost() const;
 
-	String getUri() const;
+	const String &getUri() const;
 	String splitVirtualPath(const String &urlPath) const;
 
-	String getTarget() const;
+	const String &getTarget() const;
+
+	// Inline dispatch runs on the I/O completion thread instead of queueing.
+	void setInlineDispatch(bool inlineDispatch);
+	virtual bool canDispatchInline() const;
+
+	// Set when the provider is configured with concurrency limits.
+	GatewayBulkhead *getBulkhead() const;
 
 	void beginDispatch(GatewayContext *context, const HttpUri &uri);
 
@@ -37,11 +50,19 @@ protected:
 
 	String m_basicAuthRealm;
 	PropertyMap m_basicAuthUsers;
+	bool m_systemAuth{ false };
+
+	bool m_inlineDispatch{ false };
+
+	GatewayBulkheadPtr m_bulkhead;
 
 	GatewayHost *m_host{ nullptr };
 
 protected:
 	void syncConnectionType(HttpRequest &request, HttpResponse &response);
+
+	// The labels every metric of the provider carries.
+	String getMetricLabels() const;
 };
 
 using GatewayProviderPtr = RefPointer<GatewayProvider>;
@@ -78,6 +99,9 @@ class GatewayFileProvider : public GatewayProvider
 public:
 	GatewayFileProvider(GatewayHost *host, const Xml &config, const String &target);
 
+	// Files are read synchronously.
+	virtual bool canDispatchInline() const override;
+
 protected:
 	virtual void dispatchRequest(GatewayContext *context, const HttpUri &uri);
 
@@ -85,11 +109,57 @@ private:
 	String m_defaultFile;
 	String m_defaultExtension;
 	PropertyMap m_responseHeaders;
+
+	static const size_t DEFAULT_CACHE_FILE_SIZE = 65536;
+	static const uint64_t DEFAULT_TRANSFER_FILE_SIZE = 1024 * 1024;
+
+	GatewayFileCachePtr m_cache;
+	uint64_t m_transferFileSize{ DEFAULT_TRANSFER_FILE_SIZE };
+
+	struct Encoding
+	{
+		String m_name;
+		String m_extension;
+	};
+
+	// Precompressed siblings, in order of preference.
+	std::vector<Encoding> m_encodings;
+
+	// One bit per configured encoding the client accepts.
+	unsigned acceptedEncodings(const HttpRequest &request) const;
+
+	bool resolveFile(const String &pathInfo, unsigned acceptedEncodings, GatewayFileSource &source) const;
+
+	// Answers reads from the cache or file transfers; false leaves the request
+	// to the file handler.
+	bool sendFile(GatewayContext *context, const String &pathInfo);
+	bool sendFileTransfer(
+		GatewayContext *context,
+		const GatewayFileSource &source,
+		const String &range,
+		bool headRequest,
+		bool keepAlive);
 };
 
 using GatewayFileProviderPtr = RefPointer<GatewayFileProvider>;
 
 
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMetricsProvider
+//
+
+class GatewayMetricsProvider : public GatewayProvider
+{
+public:
+	GatewayMetricsProvider(GatewayHost *host, const Xml &config, const String &target);
+
+protected:
+	virtual void dispatchRequest(GatewayContext *context, const HttpUri &uri);
+};
+
+using GatewayMetricsProviderPtr = RefPointer<GatewayMetricsProvider>;
+
+
 //////////////////////////////////////////////////////////////////////////
 // class GatewayServerProvider
 //
@@ -105,7 +175,10 @@ protected:
 
 	virtual void dispatchRequest(GatewayContext *context, const HttpUri &uri);
 
-	void sendToServer(GatewayContext *context, NetStreamPtr serverStream);
+	class ConnectionPool;
+
+	// Without a pool, the provider's own.
+	void sendToServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool = nullptr, unsigned attempt = 0);
 
 protected:
 	/* Options */
@@ -113,12 +186,37 @@ protected:
 	String m_newPath;
 	String m_newQuery;
 
+	bool m_streamResponses{ false };
+	size_t m_streamBufferSize{ 0 };
+	size_t m_relayBufferSize{ 0 };
+
+	/* Retries */
+	static const unsigned DEFAULT_MAX_RETRIES = 2;
+	static const unsigned DEFAULT_RETRY_BUDGET = 20;		// percent of requests
+	static const unsigned DEFAULT_MIN_RETRIES = 10;			// per second
+
+	unsigned m_maxRetries{ 0 };
+	bool m_hedge{ false };
+	GatewayRetryBudgetPtr m_retryBudget;
+
 	/* Connection Pooling */
-	class ConnectionPool : public NetConnectionPool, public RefCounter
+	static const unsigned DEFAULT_IDLE_TIMEOUT = 30;
+	static const unsigned DEFAULT_QUEUE_TIMEOUT = 5000;
+
+	class ConnectionPool : public GatewayConnectionPool
 	{
 	public:
 		using Ptr = RefPointer<ConnectionPool>;
 
+		ConnectionPool(const String &labels, const Options &options, const String &connector, const String &key) :
+			GatewayConnectionPool(labels, options),
+			m_connector(connector),
+			m_key(key)
+		{
+		}
+
+		const String m_connector;
+		const String m_key;
 		std::atomic<long> m_acquisitionCount{ 0 };
 	};
 	class ConnectionPoolMap : public std::unordered_map<String, ConnectionPool::Ptr>, public RefCounter
@@ -130,16 +228,81 @@ protected:
 	ConnectionPool::Ptr m_connectionPool;
 	ConnectionPoolMap::Ptr m_connectionPoolMap;
 
+	// With an upstream group, each request gets the pool of the member the
+	// group selects instead.
+	GatewayUpstreamPtr m_upstream;
+	std::vector<ConnectionPool::Ptr> m_memberPools;
+
 	static SyncMutex sm_connectionPoolMapMutex;
 	static ConnectionPoolMap *sm_connectionPoolMap;
+	static unsigned sm_connectionPoolSerial;
 
 	void initConnectionPoolMap();
 	
-	static ConnectionPool *AcquireConnectionPool(const String &connector, bool init = true);
-	static bool ReleaseConnectionPool(const String &connector);
+	// Providers share a pool if they agree on the connector and its options,
+	// so reloaded options take effect with the providers that bring them.
+	static ConnectionPool *AcquireConnectionPool(const String &connector, const GatewayConnectionPool::Options &options, bool init = true);
+	static bool ReleaseConnectionPool(ConnectionPool *pool);
+
+	void initUpstream(const Xml &upstreamConfig, const GatewayConnectionPool::Options &poolOptions);
+
+	virtual bool allocateConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool::Ptr &pool, unsigned attempt = 0);
+	bool allocatePooledConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool *pool, unsigned attempt);
+	virtual void freeConnection(NetStreamPtr serverStream, ConnectionPool *pool = nullptr, unsigned keepAliveTimeout = 0);
 
-	virtual bool allocateConnection(GatewayContext *context, NetStreamPtr &serverStream);
-	virtual void freeConnection(NetStreamPtr serverStream, ConnectionPool *pool = nullptr);
+private:
+	// Two requests raced for one response: the first to answer is relayed at
+	// once and the loser closed; its i/o ends on its own, without the context.
+	// The hedge is sent from a copy of the head and to a member picked up
+	// front, so it never reads the request while the context moves on.
+	class HedgedExchange : public RefCounter
+	{
+	public:
+		using Ptr = RefPointer<HedgedExchange>;
+
+		struct Attempt
+		{
+			NetStreamPtr m_stream;
+			ConnectionPool::Ptr m_pool;
+			HttpResponsePtr m_response;
+			bool m_active{ false };
+			bool m_cancelled{ false };
+		};
+
+		HedgedExchange(GatewayContext *context, unsigned attempt) :
+			m_context(context),
+			m_attempt(attempt)
+		{
+		}
+
+		GatewayContext *m_context;
+		unsigned m_attempt;				// retries so far
+		String m_hedgeHead;				// the request, serialized
+
+		SyncMutex m_mutex;
+		Attempt m_attempts[2];
+		int m_winner{ -1 };
+		size_t m_pending{ 1 };
+		bool m_hedging{ false };		// the hedge still uses the context
+		bool m_relayed{ false };
+	};
+
+	// Attempts after the first are retries.
+	void forwardRequest(GatewayContext *context, unsigned attempt);
+	void failRequest(GatewayContext *context, unsigned attempt, bool replayable);
+	bool isReplayable(GatewayContext *context) const;
+
+	void streamToServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt);
+	void receiveFromServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt);
+	void relayResponse(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, HttpResponsePtr serverResponse);
+	void streamFromServer(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt);
+
+	bool canHedge(GatewayContext *context, ConnectionPool *pool) const;
+	void receiveHedged(GatewayContext *context, NetStreamPtr serverStream, ConnectionPool *pool, unsigned attempt);
+	void sendHedge(HedgedExchange::Ptr exchange);
+	void receiveAttempt(HedgedExchange::Ptr exchange, size_t index);
+	void endAttempt(HedgedExchange::Ptr exchange, size_t index, bool succeeded);
+	void relayWinner(HedgedExchange::Ptr exchange);
 };
 
 using GatewayServerProviderPtr = RefPointer<GatewayServerProvider>;
@@ -160,8 +323,8 @@ protected:
 	virtual void dispatchRequest(GatewayContext *context, const HttpUri &uri) override;
 
 	// Allocate/free remote origin server connection.
-	virtual bool allocateConnection(GatewayContext *context, NetStreamPtr &serverStream) override;
-	virtual void freeConnection(NetStreamPtr serverStream, ConnectionPool *pool = nullptr) override;
+	virtual bool allocateConnection(GatewayContext *context, NetStreamPtr &serverStream, ConnectionPool::Ptr &pool, unsigned attempt = 0) override;
+	virtual void freeConnection(NetStreamPtr serverStream, ConnectionPool *pool = nullptr, unsigned keepAliveTimeout = 0) override;
 
 	virtual void onWebSocketError(ServerContext *context, ServerContext::Error &error) override;
 	virtual void onWebSocketClose(ServerContext *context) override;
@@ -206,6 +369,8 @@ public:
 	GatewaySubscriberProvider(GatewayHost *host, const Xml &config, const String &target);
 	virtual ~GatewaySubscriberProvider();
 
+	virtual bool canDispatchInline() const override;
+
 protected:
 	virtual void dispatchRequest(GatewayContext *context, const HttpUri &uri) override;
 
@@ -237,7 +402,7 @@ inline GatewayHost *GatewayProvider::getHost() const
 	return m_host;
 }
 
-inline String GatewayProvider::getUri() const
+inline const String &GatewayProvider::getUri() const
 {
 	return m_uri;
 }
@@ -261,11 +426,28 @@ inline String GatewayProvider::splitVirtualPath(
 	return virtualPath;
 }
 
-inline String GatewayProvider::getTarget() const
+inline const String &GatewayProvider::getTarget() const
 {
 	return m_target;
 }
 
+inline void GatewayProvider::setInlineDispatch(bool inlineDispatch)
+{
+	m_inlineDispatch = inlineDispatch;
+}
+
+inline bool GatewayProvider::canDispatchInline() const
+{
+	// System authentication blocks on the domain controller, and bulkheads
+	// bound the executor threads a provider may occupy.
+	return m_inlineDispatch && !m_systemAuth && !m_bulkhead;
+}
+
+inline GatewayBulkhead *GatewayProvider::getBulkhead() const
+{
+	return m_bulkhead;
+}
+
 inline void GatewayProvider::syncConnectionType(HttpRequest &request, HttpResponse &response)
 {
 	String type = response.getHeader(HttpHeader::CONNECTION);
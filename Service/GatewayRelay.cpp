@@ -0,0 +1,271 @@
+#include "pch.h"
+#include "GatewayRelay.h"
+#include "GatewayBufferPool.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayRelay
+//
+
+void GatewayRelay::attach(NetStream *clientStream, NetStream *serverStream)
+{
+	m_clientStream = clientStream;
+	m_serverStream = serverStream;
+}
+
+void GatewayRelay::begin(size_t bufferSize, handler_t &&handler)
+{
+	m_handler = std::move(handler);
+
+	m_upstream.init(this, m_clientStream, m_serverStream, bufferSize);
+	m_downstream.init(this, m_serverStream, m_clientStream, bufferSize);
+
+	m_activeChannels = 2;
+
+	m_downstream.start();
+	m_upstream.start();
+}
+
+void GatewayRelay::close()
+{
+	// Pending operations fail and wind both channels down.
+	if (isActive())
+	{
+		m_clientStream->close();
+		m_serverStream->close();
+	}
+}
+
+void GatewayRelay::reset()
+{
+	assert(!isActive());
+
+	m_upstream.free();
+	m_downstream.free();
+
+	m_clientStream = nullptr;
+	m_serverStream = nullptr;
+	m_handler = nullptr;
+}
+
+
+void GatewayRelay::endChannel()
+{
+	// One direction ending tears down the other.
+	m_clientStream->close();
+	m_serverStream->close();
+
+	if (--m_activeChannels == 0)
+	{
+		handler_t handler = std::move(m_handler);
+		m_handler = nullptr;
+
+		handler();
+	}
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayRelay::Channel
+//
+
+void GatewayRelay::Channel::init(GatewayRelay *relay, NetStream *source, NetStream *sink, size_t bufferSize)
+{
+	m_relay = relay;
+	m_source = source;
+	m_sink = sink;
+
+	m_bufferSize = GatewayBufferPool::GetCapacity(bufferSize);
+	m_waitForData = false;
+
+	m_readIndex = 0;
+	m_writeIndex = 0;
+	m_state = READING;
+}
+
+void GatewayRelay::Channel::free()
+{
+	for (char *&buffer : m_buffers)
+	{
+		GatewayBufferPool::Free(buffer, m_bufferSize);
+		buffer = nullptr;
+	}
+
+	m_source = nullptr;
+	m_sink = nullptr;
+	m_state = 0;
+}
+
+
+void GatewayRelay::Channel::start()
+{
+	read();
+}
+
+void GatewayRelay::Channel::read()
+{
+	// TLS streams may already hold decrypted data, so they always read,
+	// and hold a buffer even while idle.
+	if (m_waitForData && !m_source->isSecure())
+	{
+		m_source->read(
+			nullptr, 0,
+			[this](IoState *state) mutable
+			{
+				if (state->succeeded())
+				{
+					readData();
+				}
+				else
+				{
+					endRead(0);
+				}
+			}
+		);
+	}
+	else
+	{
+		readData();
+	}
+}
+
+void GatewayRelay::Channel::readData()
+{
+	char *&buffer = m_buffers[m_readIndex];
+	if (!buffer)
+	{
+		buffer = GatewayBufferPool::Alloc(m_bufferSize);
+	}
+
+	m_source->read(
+		buffer, m_bufferSize,
+		[this](IoState *state) mutable
+		{
+			endRead(state->getTransferCount());
+		}
+	);
+}
+
+void GatewayRelay::Channel::write()
+{
+	m_sink->write(
+		m_buffers[m_writeIndex], m_counts[m_writeIndex],
+		[this](IoState *state) mutable
+		{
+			endWrite(state->succeeded());
+		}
+	);
+}
+
+
+void GatewayRelay::Channel::endRead(size_t count)
+{
+	m_waitForData = (count < m_bufferSize);
+
+	if (count)
+	{
+		m_counts[m_readIndex] = count;
+		m_readIndex ^= 1;
+	}
+
+	unsigned state = m_state;
+	unsigned next;
+	do
+	{
+		next = state & ~READING;
+
+		if (count && !(state & CLOSED))
+		{
+			// Queue the buffer; keep reading while the other one is free.
+			next += FILLED_ONE;
+			next |= WRITING;
+
+			if (GetFilled(next) < 2)
+			{
+				next |= READING;
+			}
+		}
+		else
+		{
+			// Let queued data drain before the channel ends.
+			next |= CLOSED;
+		}
+	}
+	while (!m_state.compare_exchange_weak(state, next));
+
+	if ((next & WRITING) && !(state & WRITING))
+	{
+		write();
+	}
+
+	if (next & READING)
+	{
+		read();
+	}
+
+	update(next);
+}
+
+void GatewayRelay::Channel::endWrite(bool succeeded)
+{
+	// Return the drained buffer before the reader can claim its slot.
+	GatewayBufferPool::Free(m_buffers[m_writeIndex], m_bufferSize);
+	m_buffers[m_writeIndex] = nullptr;
+
+	m_writeIndex ^= 1;
+
+	unsigned state = m_state;
+	unsigned next;
+	do
+	{
+		next = (state - FILLED_ONE) & ~WRITING;
+
+		if (!succeeded)
+		{
+			next = (next & ~FILLED_MASK) | CLOSED;
+		}
+		else
+		{
+			if (GetFilled(next))
+			{
+				next |= WRITING;
+			}
+
+			// A read may have stalled on two full buffers.
+			if (!(next & (READING | CLOSED)))
+			{
+				next |= READING;
+			}
+		}
+	}
+	while (!m_state.compare_exchange_weak(state, next));
+
+	if (!succeeded)
+	{
+		// Fail the pending read, if any.
+		m_relay->m_clientStream->close();
+		m_relay->m_serverStream->close();
+	}
+
+	if (next & WRITING)
+	{
+		write();
+	}
+
+	if ((next & READING) && !(state & READING))
+	{
+		read();
+	}
+
+	update(next);
+}
+
+void GatewayRelay::Channel::update(unsigned state)
+{
+	// Exactly one completion observes the channel closed and idle.
+	if ((state & CLOSED) && !(state & (READING | WRITING)))
+	{
+		m_relay->endChannel();
+	}
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayRelay
+//
+// Relays an upgraded connection in both directions. Each direction reads
+// into one of two buffers while the other is being written, and tracks its
+// in-flight operations in a single atomic word instead of taking a lock.
+// Buffers come from GatewayBufferPool and are only held while a read is
+// pending or data is queued; an idle plain connection waits for data with
+// a zero-byte read and holds no buffer at all. TLS connections don't: their
+// stream may already hold decrypted data a zero-byte read would not report,
+// so an idle TLS direction keeps one buffer in a pending read.
+//
+
+class GatewayRelay
+{
+public:
+	using handler_t = std::function<void()>;
+
+	GatewayRelay();
+	~GatewayRelay();
+
+	bool isStarted() const;
+	bool isActive() const;
+
+	void attach(NetStream *clientStream, NetStream *serverStream);
+
+	// The handler runs once, after both directions have ended.
+	void begin(size_t bufferSize, handler_t &&handler);
+	void close();
+	void reset();
+
+private:
+	class Channel
+	{
+	public:
+		void init(GatewayRelay *relay, NetStream *source, NetStream *sink, size_t bufferSize);
+		void free();
+
+		void start();
+
+	private:
+		enum : unsigned
+		{
+			READING = 0x01,
+			WRITING = 0x02,
+			CLOSED = 0x04,
+			FILLED_ONE = 0x08,
+			FILLED_MASK = 0x18,
+		};
+
+		GatewayRelay *m_relay{ nullptr };
+		NetStream *m_source{ nullptr };
+		NetStream *m_sink{ nullptr };
+
+		char *m_buffers[2]{ nullptr, nullptr };
+		size_t m_counts[2]{ 0, 0 };
+		size_t m_bufferSize{ 0 };
+
+		// Set when the last read drained the socket.
+		bool m_waitForData{ false };
+
+		// Only touched by the single pending read or write, respectively.
+		unsigned m_readIndex{ 0 };
+		unsigned m_writeIndex{ 0 };
+
+		std::atomic<unsigned> m_state{ 0 };
+
+		static unsigned GetFilled(unsigned state);
+
+		void read();
+		void readData();
+		void write();
+		void endRead(size_t count);
+		void endWrite(bool succeeded);
+		void update(unsigned state);
+	};
+
+	NetStreamPtr m_clientStream;
+	NetStreamPtr m_serverStream;
+
+	Channel m_upstream;
+	Channel m_downstream;
+
+	std::atomic<int> m_activeChannels{ 0 };
+	handler_t m_handler;
+
+	void endChannel();
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline GatewayRelay::GatewayRelay()
+{
+}
+
+inline GatewayRelay::~GatewayRelay()
+{
+	reset();
+}
+
+inline bool GatewayRelay::isStarted() const
+{
+	return m_clientStream != nullptr;
+}
+
+inline bool GatewayRelay::isActive() const
+{
+	return m_activeChannels > 0;
+}
+
+inline unsigned GatewayRelay::Channel::GetFilled(unsigned state)
+{
+	return (state & FILLED_MASK) / FILLED_ONE;
+}
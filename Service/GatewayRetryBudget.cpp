@@ -0,0 +1,93 @@
+#include "pch.h"
+#include "GatewayRetryBudget.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayRetryBudget
+//
+
+SyncMutex GatewayRetryBudget::sm_budgetMutex;
+std::set<GatewayRetryBudget*> GatewayRetryBudget::sm_budgets;
+
+
+GatewayRetryBudget::GatewayRetryBudget(const String &labels, unsigned ratio, unsigned minPerSecond) :
+	m_labels(labels),
+	m_ratio(ratio),
+	m_minPerSecond(minPerSecond)
+{
+	SyncLock lock(sm_budgetMutex);
+	sm_budgets.insert(this);
+}
+
+GatewayRetryBudget::~GatewayRetryBudget()
+{
+	SyncLock lock(sm_budgetMutex);
+	sm_budgets.erase(this);
+}
+
+
+void GatewayRetryBudget::deposit()
+{
+	SyncLock lock(m_mutex);
+	m_balance = std::min(m_balance + m_ratio, MAX_BALANCE * 100);
+}
+
+bool GatewayRetryBudget::withdraw(bool hedge)
+{
+	uint64_t second = AfxGetTickCount() / 1000;
+
+	{
+		SyncLock lock(m_mutex);
+
+		if (second != m_second)
+		{
+			m_second = second;
+			m_reserve = m_minPerSecond;
+		}
+
+		if (m_reserve)
+		{
+			m_reserve--;
+		}
+		else if (m_balance >= 100)
+		{
+			m_balance -= 100;
+		}
+		else
+		{
+			m_deniedCount++;
+			return false;
+		}
+	}
+
+	if (hedge)
+	{
+		m_hedgeCount++;
+	}
+	else
+	{
+		m_retryCount++;
+	}
+
+	return true;
+}
+
+void GatewayRetryBudget::countHedgeWin()
+{
+	m_hedgeWinCount++;
+}
+
+
+void GatewayRetryBudget::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	SyncLock registryLock(sm_budgetMutex);
+
+	for (GatewayRetryBudget *budget : sm_budgets)
+	{
+		const char *labels = budget->m_labels;
+		writer.add("gateway_retries", budget->m_retryCount, labels);
+		writer.add("gateway_hedges", budget->m_hedgeCount, labels);
+		writer.add("gateway_hedge_wins", budget->m_hedgeWinCount, labels);
+		writer.add("gateway_retries_denied", budget->m_deniedCount, labels);
+	}
+}
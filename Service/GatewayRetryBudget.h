@@ -0,0 +1,53 @@
+#pragma once
+#include "GatewayMetrics.h"
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayRetryBudget
+//
+// Bounds the extra origin requests a provider makes, retries and hedges
+// alike, to a share of its regular ones, so a struggling origin is not
+// buried under them. A few extra requests per second are always allowed,
+// so quiet providers can still retry.
+//
+
+class GatewayRetryBudget : public RefCounter
+{
+public:
+	// The ratio is in percent of regular requests.
+	GatewayRetryBudget(const String &labels, unsigned ratio, unsigned minPerSecond);
+	virtual ~GatewayRetryBudget();
+
+	// Every regular request adds to the budget.
+	void deposit();
+
+	// False if the budget is spent.
+	bool withdraw(bool hedge);
+
+	void countHedgeWin();
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	// Unused budget is kept for at most this many extra requests.
+	static const unsigned MAX_BALANCE = 100;
+
+	String m_labels;
+	unsigned m_ratio;
+	unsigned m_minPerSecond;
+
+	SyncMutex m_mutex;
+	unsigned m_balance{ 0 };				// hundredths of a request
+	unsigned m_reserve{ 0 };				// left for the current second
+	uint64_t m_second{ 0 };
+
+	std::atomic<uint64_t> m_retryCount{ 0 };
+	std::atomic<uint64_t> m_hedgeCount{ 0 };
+	std::atomic<uint64_t> m_hedgeWinCount{ 0 };
+	std::atomic<uint64_t> m_deniedCount{ 0 };
+
+	static SyncMutex sm_budgetMutex;
+	static std::set<GatewayRetryBudget*> sm_budgets;
+};
+
+using GatewayRetryBudgetPtr = RefPointer<GatewayRetryBudget>;
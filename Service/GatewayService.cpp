@@ -1,6 +1,8 @@
 #include "pch.h"
 #include <AfxCore/NetTls.h>
 #include "GatewayService.h"
+#include "GatewayBufferPool.h"
+#include "GatewayExecutor.h"
 
 
 static const String SERVICE_CONFIG_FILENAME = "service.xml";
@@ -32,6 +34,23 @@ bool OmnebulaGatewayServiceApp::initApp()
 		return false;
 	}
 
+	GatewayMetrics::AddSource(GatewayBufferPool::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayContext::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayExecutor::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayBulkhead::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayFileCache::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayConnectionPool::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayUpstream::WriteMetrics);
+	GatewayMetrics::AddSource(GatewayRetryBudget::WriteMetrics);
+	GatewayMetrics::AddSource(
+		[](GatewayMetrics::Writer &writer)
+		{
+			GatewayObjectPool<GatewayContext>::WriteMetrics(writer, "type=\"context\"");
+			GatewayObjectPool<GatewayResponse>::WriteMetrics(writer, "type=\"response\"");
+			GatewayObjectPool<GatewayServerResponse>::WriteMetrics(writer, "type=\"server-response\"");
+		}
+	);
+
 	if (!initConfigs())
 	{
 		return false;
@@ -87,6 +106,16 @@ bool OmnebulaGatewayServiceApp::loadServiceConfig(Xml &serviceConfig)
 		return false;
 	}
 
+	if (!initServiceStreaming(serviceConfig))
+	{
+		return false;
+	}
+
+	if (!initServiceExecutor(serviceConfig))
+	{
+		return false;
+	}
+
 	return true;
 }
 
@@ -163,6 +192,46 @@ bool OmnebulaGatewayServiceApp::initServiceTimeouts(Xml &serviceConfig)
 	return true;
 }
 
+bool OmnebulaGatewayServiceApp::initServiceStreaming(Xml &serviceConfig)
+{
+	Xml streamingConfig = serviceConfig["io"]["streaming"];
+	if (!streamingConfig.isNull())
+	{
+		m_streamSettings.StreamRequests = streamingConfig.getAttribute("request") == "true";
+
+		size_t bufferSize = StringToInt(streamingConfig.getAttribute("buffer"));
+		if (bufferSize)
+		{
+			m_streamSettings.BufferSize = bufferSize;
+		}
+	}
+
+	return true;
+}
+
+bool OmnebulaGatewayServiceApp::initServiceExecutor(Xml &serviceConfig)
+{
+	Xml executorConfig = serviceConfig["io"]["executor"];
+	if (executorConfig.isNull())
+	{
+		return true;
+	}
+
+	// Workers are started once; changes take effect on restart.
+	if (GatewayExecutor::IsStarted())
+	{
+		return true;
+	}
+
+	// "auto" (or no count) runs one worker per logical processor.
+	size_t workerCount = StringToInt(executorConfig.getAttribute("workers"));
+	bool pinWorkers = executorConfig.getAttribute("pin") != "false";
+
+	GatewayExecutor::Start(workerCount, pinWorkers);
+
+	return true;
+}
+
 
 bool OmnebulaGatewayServiceApp::loadHostConfig(Xml &hostsConfig)
 {
@@ -233,5 +302,7 @@ void OmnebulaGatewayServiceApp::exitApp()
 
 	m_configMonitor.stop();
 
+	GatewayExecutor::Stop();
+
 	ServiceApp::exitApp();
 }
@@ -13,6 +13,7 @@ public:
 	OmnebulaGatewayServiceApp();
 
 	HttpConnectionSettings &getConnectionSettings();
+	GatewayStreamSettings &getStreamSettings();
 
 protected:
 	virtual bool initApp();
@@ -23,6 +24,8 @@ protected:
 	bool loadServiceConfig(Xml &serviceConfig);
 	bool initServiceCertificates(Xml &serviceConfig);
 	bool initServiceTimeouts(Xml &serviceConfig);
+	bool initServiceStreaming(Xml &serviceConfig);
+	bool initServiceExecutor(Xml &serviceConfig);
 	bool loadHostConfig(Xml &hostsConfig);
 
 private:
@@ -34,6 +37,7 @@ private:
 	ConfigMonitor m_configMonitor;
 
 	HttpConnectionSettings m_connectionSettings;
+	GatewayStreamSettings m_streamSettings;
 };
 
 
@@ -44,3 +48,8 @@ inline HttpConnectionSettings &OmnebulaGatewayServiceApp::getConnectionSettings(
 {
 	return m_connectionSettings;
 }
+
+inline GatewayStreamSettings &OmnebulaGatewayServiceApp::getStreamSettings()
+{
+	return m_streamSettings;
+}
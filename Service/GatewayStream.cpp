@@ -0,0 +1,719 @@
+#include "pch.h"
+#include "GatewayStream.h"
+#include "GatewayBufferPool.h"
+
+
+static const char HTTP_VERSION_PREFIX[] = "HTTP/";
+static const char HTTP_VERSION_1_0[] = "HTTP/1.0";
+static const char CHUNKED_CODING[] = "chunked";
+static const char CLOSE_CONNECTION[] = "close";
+static const char KEEP_ALIVE_CONNECTION[] = "keep-alive";
+
+
+static inline bool __ParseLength(const String &value, uint64_t &length)
+{
+	const char *current = value;
+	if (!*current)
+	{
+		return false;
+	}
+
+	length = 0;
+	for (; *current; ++current)
+	{
+		if ((*current < '0') || (*current > '9') || (length > (UINT64_MAX / 10) - 1))
+		{
+			return false;
+		}
+		length = (length * 10) + (*current - '0');
+	}
+
+	return true;
+}
+
+static inline bool __IsFinalCoding(const GatewayMessageHead &head, const char *coding)
+{
+	// The coding must be the last one applied, and applied only once.
+	bool isFinal = false;
+
+	for (auto &header : head.getHeaders())
+	{
+		if (header.first.compareNoCase(HttpHeader::TRANSFER_ENCODING) == 0)
+		{
+			StringVector values;
+			header.second.splice(",", values);
+
+			for (auto &value : values)
+			{
+				String name = value.trim();
+				if (name.isEmpty())
+				{
+					continue;
+				}
+				if (isFinal)
+				{
+					return false;
+				}
+				isFinal = (name.compareNoCase(coding) == 0);
+			}
+		}
+	}
+
+	return isFinal;
+}
+
+static inline bool __GetContentLength(const GatewayMessageHead &head, uint64_t &length)
+{
+	// Repeated values are only accepted if they all agree.
+	bool hasLength = false;
+
+	for (auto &header : head.getHeaders())
+	{
+		if (header.first.compareNoCase(HttpHeader::CONTENT_LENGTH) == 0)
+		{
+			StringVector values;
+			header.second.splice(",", values);
+
+			for (auto &value : values)
+			{
+				uint64_t valueLength;
+				if (!__ParseLength(value.trim(), valueLength) || (hasLength && (valueLength != length)))
+				{
+					return false;
+				}
+				length = valueLength;
+				hasLength = true;
+			}
+		}
+	}
+
+	return hasLength;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMessageHead
+//
+
+size_t GatewayMessageHead::FindEnd(const char *data, size_t length)
+{
+	for (size_t pos = 0; pos < length; ++pos)
+	{
+		if (data[pos] == '\n')
+		{
+			if ((pos + 1 < length) && (data[pos + 1] == '\n'))
+			{
+				return pos + 2;
+			}
+			if ((pos + 2 < length) && (data[pos + 1] == '\r') && (data[pos + 2] == '\n'))
+			{
+				return pos + 3;
+			}
+		}
+	}
+	return 0;
+}
+
+
+bool GatewayMessageHead::parse(const char *data, size_t length)
+{
+	clear();
+
+	const char *end = data + length;
+	const char *line = data;
+	bool isStartLine = true;
+
+	while (line < end)
+	{
+		const char *lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+		if (!lineEnd)
+		{
+			return false;
+		}
+
+		const char *next = lineEnd + 1;
+		if ((lineEnd > line) && (lineEnd[-1] == '\r'))
+		{
+			--lineEnd;
+		}
+
+		// Blank line terminates the head.
+		if (lineEnd == line)
+		{
+			return !isStartLine;
+		}
+
+		if (isStartLine)
+		{
+			const char *first = static_cast<const char *>(memchr(line, ' ', lineEnd - line));
+			const char *second = first ? static_cast<const char *>(memchr(first + 1, ' ', lineEnd - first - 1)) : nullptr;
+			if (!first)
+			{
+				return false;
+			}
+
+			m_startLine[0] = String(line, first - line);
+			if (second)
+			{
+				m_startLine[1] = String(first + 1, second - first - 1);
+				m_startLine[2] = String(second + 1, lineEnd - second - 1);
+			}
+			else
+			{
+				m_startLine[1] = String(first + 1, lineEnd - first - 1);
+			}
+
+			if (strncmp(m_startLine[0], HTTP_VERSION_PREFIX, sizeof(HTTP_VERSION_PREFIX) - 1) == 0)
+			{
+				m_statusCode = StringToInt(m_startLine[1]);
+				if ((m_statusCode < 100) || (m_statusCode > 999))
+				{
+					return false;
+				}
+			}
+			else if (!second || m_startLine[1].isEmpty())
+			{
+				return false;
+			}
+
+			isStartLine = false;
+		}
+		else
+		{
+			// Obsolete line folding is rejected rather than unfolded.
+			if ((*line == ' ') || (*line == '\t'))
+			{
+				return false;
+			}
+
+			const char *colon = static_cast<const char *>(memchr(line, ':', lineEnd - line));
+			if (!colon || (colon == line))
+			{
+				return false;
+			}
+
+			// Whitespace before the colon makes the name ambiguous between
+			// hops; requests are rejected, responses have it removed.
+			const char *nameEnd = colon;
+			while ((nameEnd > line) && ((nameEnd[-1] == ' ') || (nameEnd[-1] == '\t')))
+			{
+				--nameEnd;
+			}
+			if ((nameEnd != colon) && (!isResponse() || (nameEnd == line)))
+			{
+				return false;
+			}
+
+			String name(line, nameEnd - line);
+			String value(colon + 1, lineEnd - colon - 1);
+			m_headers.emplace_back(name, value.trim());
+		}
+
+		line = next;
+	}
+
+	return false;
+}
+
+
+String GatewayMessageHead::getHeader(const char *name) const
+{
+	const String *value = findHeader(name);
+	return value ? *value : String();
+}
+
+bool GatewayMessageHead::hasToken(const char *name, const char *token) const
+{
+	for (auto &header : m_headers)
+	{
+		if (header.first.compareNoCase(name) == 0)
+		{
+			StringVector values;
+			header.second.splice(",", values);
+
+			for (auto &value : values)
+			{
+				if (value.trim().compareNoCase(token) == 0)
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+
+void GatewayMessageHead::setHeader(const char *name, const char *value)
+{
+	removeHeader(name);
+	addHeader(name, value);
+}
+
+void GatewayMessageHead::removeHeader(const char *name)
+{
+	m_headers.erase(
+		std::remove_if(
+			m_headers.begin(),
+			m_headers.end(),
+			[name](const std::pair<String, String> &header) { return header.first.compareNoCase(name) == 0; }),
+		m_headers.end());
+}
+
+
+bool GatewayMessageHead::isKeepAlive() const
+{
+	if (getVersion().compareNoCase(HTTP_VERSION_1_0) == 0)
+	{
+		return hasToken(HttpHeader::CONNECTION, KEEP_ALIVE_CONNECTION);
+	}
+	return !hasToken(HttpHeader::CONNECTION, CLOSE_CONNECTION);
+}
+
+
+String GatewayMessageHead::format() const
+{
+	String text;
+
+	text.format("%s %s", m_startLine[0], m_startLine[1]);
+	if (!m_startLine[2].isEmpty())
+	{
+		text += " ";
+		text += m_startLine[2];
+	}
+	text += "\r\n";
+
+	for (auto &header : m_headers)
+	{
+		text += header.first;
+		text += ": ";
+		text += header.second;
+		text += "\r\n";
+	}
+	text += "\r\n";
+
+	return text;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBodyFramer
+//
+
+GatewayBodyFramer GatewayBodyFramer::ForRequest(const GatewayMessageHead &head)
+{
+	if (head.hasHeader(HttpHeader::TRANSFER_ENCODING))
+	{
+		// Requests may only be delimited by a final chunked coding; any
+		// Content-Length alongside it is ignored and stripped by the caller.
+		if (!__IsFinalCoding(head, CHUNKED_CODING))
+		{
+			GatewayBodyFramer framer(Mode::CHUNKED);
+			framer.m_state = State::INVALID;
+			return framer;
+		}
+		return GatewayBodyFramer(Mode::CHUNKED);
+	}
+
+	if (head.hasHeader(HttpHeader::CONTENT_LENGTH))
+	{
+		uint64_t length;
+		if (!__GetContentLength(head, length))
+		{
+			GatewayBodyFramer framer(Mode::LENGTH, 1);
+			framer.m_state = State::INVALID;
+			return framer;
+		}
+		return GatewayBodyFramer(Mode::LENGTH, length);
+	}
+
+	return GatewayBodyFramer(Mode::NONE);
+}
+
+GatewayBodyFramer GatewayBodyFramer::ForResponse(const GatewayMessageHead &head, const char *requestMethod)
+{
+	int statusCode = head.getStatusCode();
+	if (((statusCode >= 100) && (statusCode < 200))
+		|| (statusCode == HttpStatus::NO_CONTENT)
+		|| (statusCode == HttpStatus::NOT_MODIFIED)
+		|| (requestMethod && (strcmp(requestMethod, "HEAD") == 0)))
+	{
+		return GatewayBodyFramer(Mode::NONE);
+	}
+
+	if (head.hasHeader(HttpHeader::TRANSFER_ENCODING))
+	{
+		return GatewayBodyFramer(head.hasToken(HttpHeader::TRANSFER_ENCODING, CHUNKED_CODING) ? Mode::CHUNKED : Mode::CLOSE);
+	}
+
+	if (head.hasHeader(HttpHeader::CONTENT_LENGTH))
+	{
+		uint64_t length;
+		if (__GetContentLength(head, length))
+		{
+			return GatewayBodyFramer(Mode::LENGTH, length);
+		}
+	}
+
+	return GatewayBodyFramer(Mode::CLOSE);
+}
+
+
+size_t GatewayBodyFramer::consume(const char *data, size_t length)
+{
+	switch (m_mode)
+	{
+	case Mode::LENGTH:
+		if (m_state == State::DATA)
+		{
+			size_t count = static_cast<size_t>(std::min<uint64_t>(m_remaining, length));
+			m_remaining -= count;
+			if (m_remaining == 0)
+			{
+				m_state = State::DONE;
+			}
+			return count;
+		}
+		return 0;
+
+	case Mode::CHUNKED:
+		return consumeChunked(data, length);
+
+	case Mode::CLOSE:
+		return m_state == State::DATA ? length : 0;
+
+	default:
+		return 0;
+	}
+}
+
+size_t GatewayBodyFramer::consumeChunked(const char *data, size_t length)
+{
+	size_t pos = 0;
+
+	while ((pos < length) && (m_state != State::DONE) && (m_state != State::INVALID))
+	{
+		char ch = data[pos];
+
+		switch (m_state)
+		{
+		case State::SIZE:
+			if (isxdigit(static_cast<unsigned char>(ch)))
+			{
+				if (m_remaining > (UINT64_MAX >> 4))
+				{
+					m_state = State::INVALID;
+					break;
+				}
+				m_remaining = (m_remaining << 4) | (isdigit(static_cast<unsigned char>(ch)) ? (ch - '0') : ((ch | 0x20) - 'a' + 10));
+				m_hasSize = true;
+			}
+			else if (!m_hasSize)
+			{
+				m_state = State::INVALID;
+			}
+			else if (ch == '\r')
+			{
+				m_state = State::SIZE_LF;
+			}
+			else if (ch == '\n')
+			{
+				m_state = m_remaining ? State::DATA : State::TRAILER;
+			}
+			else
+			{
+				m_state = State::EXTENSION;
+			}
+			pos++;
+			break;
+
+		case State::EXTENSION:
+			if (ch == '\n')
+			{
+				m_state = m_remaining ? State::DATA : State::TRAILER;
+			}
+			else if (ch == '\r')
+			{
+				m_state = State::SIZE_LF;
+			}
+			pos++;
+			break;
+
+		case State::SIZE_LF:
+			m_state = (ch != '\n') ? State::INVALID : (m_remaining ? State::DATA : State::TRAILER);
+			pos++;
+			break;
+
+		case State::DATA:
+		{
+			size_t count = static_cast<size_t>(std::min<uint64_t>(m_remaining, length - pos));
+			m_remaining -= count;
+			pos += count;
+			if (m_remaining == 0)
+			{
+				m_state = State::DATA_CR;
+			}
+			break;
+		}
+
+		case State::DATA_CR:
+		case State::DATA_LF:
+			if (ch == '\n')
+			{
+				m_state = State::SIZE;
+				m_hasSize = false;
+			}
+			else
+			{
+				m_state = ((ch == '\r') && (m_state == State::DATA_CR)) ? State::DATA_LF : State::INVALID;
+			}
+			pos++;
+			break;
+
+		case State::TRAILER:
+			m_state = (ch == '\n') ? State::DONE : ((ch == '\r') ? State::TRAILER_LF : State::TRAILER_LINE);
+			pos++;
+			break;
+
+		case State::TRAILER_LINE:
+			if (ch == '\n')
+			{
+				m_state = State::TRAILER;
+			}
+			pos++;
+			break;
+
+		case State::TRAILER_LF:
+			m_state = (ch == '\n') ? State::DONE : State::INVALID;
+			pos++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return pos;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayStreamPump
+//
+
+GatewayStreamPump::GatewayStreamPump(size_t bufferSize)
+{
+	m_capacity = GatewayBufferPool::GetCapacity(bufferSize > MIN_BUFFER_SIZE ? bufferSize : MIN_BUFFER_SIZE);
+}
+
+GatewayStreamPump::~GatewayStreamPump()
+{
+	GatewayBufferPool::Free(m_buffer, m_capacity);
+}
+
+
+void GatewayStreamPump::acquireBuffer()
+{
+	if (!m_buffer)
+	{
+		m_buffer = GatewayBufferPool::Alloc(m_capacity);
+	}
+}
+
+void GatewayStreamPump::releaseBuffer()
+{
+	if (m_buffer && !hasPendingData())
+	{
+		GatewayBufferPool::Free(m_buffer, m_capacity);
+		m_buffer = nullptr;
+		m_begin = m_end = 0;
+	}
+}
+
+
+void GatewayStreamPump::readHead(NetStream *source, handler_t &&handler)
+{
+	m_head.clear();
+	m_headSent = false;
+	m_source = source;
+
+	continueHead(std::move(handler));
+}
+
+void GatewayStreamPump::continueHead(handler_t &&handler)
+{
+	acquireBuffer();
+
+	// A head may already be waiting behind the previous message.
+	size_t headLength = GatewayMessageHead::FindEnd(getData() + m_begin, m_end - m_begin);
+	if (headLength)
+	{
+		bool parsed = m_head.parse(getData() + m_begin, headLength);
+		m_begin += headLength;
+		releaseBuffer();
+		handler(parsed);
+		return;
+	}
+
+	// Compact; the head must fit in the buffer.
+	if (m_begin > 0)
+	{
+		memmove(getData(), getData() + m_begin, m_end - m_begin);
+		m_end -= m_begin;
+		m_begin = 0;
+	}
+
+	if (m_end == m_capacity)
+	{
+		handler(false);
+		return;
+	}
+
+	GatewayStreamPumpPtr self = this;
+	m_source->read(
+		getData() + m_end, m_capacity - m_end,
+		[self, handler](IoState *state) mutable
+		{
+			size_t count = state->getTransferCount();
+			if (count)
+			{
+				self->m_end += count;
+				self->continueHead(std::move(handler));
+			}
+			else
+			{
+				handler(false);
+			}
+		}
+	);
+}
+
+
+void GatewayStreamPump::writeHead(NetStream *sink, handler_t &&handler)
+{
+	m_headText = m_head.format();
+	m_headSent = true;
+
+	GatewayStreamPumpPtr self = this;
+	sink->write(
+		static_cast<const char *>(m_headText), m_headText.getLength(),
+		[self, handler](IoState *state) mutable
+		{
+			handler(state->succeeded());
+		}
+	);
+}
+
+void GatewayStreamPump::writePending(NetStream *sink, handler_t &&handler)
+{
+	if (!hasPendingData())
+	{
+		handler(true);
+		return;
+	}
+
+	const char *data = getData() + m_begin;
+	size_t count = m_end - m_begin;
+	m_begin = m_end = 0;
+
+	GatewayStreamPumpPtr self = this;
+	sink->write(
+		data, count,
+		[self, handler](IoState *state) mutable
+		{
+			self->releaseBuffer();
+			handler(state->succeeded());
+		}
+	);
+}
+
+
+void GatewayStreamPump::pumpBody(NetStream *source, NetStream *sink, const GatewayBodyFramer &framer, handler_t &&handler)
+{
+	m_source = source;
+	m_sink = sink;
+	m_framer = framer;
+	m_handler = std::move(handler);
+
+	continueBody();
+}
+
+void GatewayStreamPump::continueBody()
+{
+	GatewayStreamPumpPtr self = this;
+
+	// Forward whatever is already buffered.
+	while (hasPendingData() && !m_framer.isComplete())
+	{
+		size_t count = m_framer.consume(getData() + m_begin, m_end - m_begin);
+		if (!m_framer.isValid())
+		{
+			endBody(false);
+			return;
+		}
+
+		const char *data = getData() + m_begin;
+		m_begin += count;
+
+		if (m_sink && count)
+		{
+			m_sink->write(
+				data, count,
+				[self](IoState *state) mutable
+				{
+					if (state->succeeded())
+					{
+						self->continueBody();
+					}
+					else
+					{
+						self->endBody(false);
+					}
+				}
+			);
+			return;
+		}
+	}
+
+	if (m_framer.isComplete())
+	{
+		endBody(true);
+		return;
+	}
+
+	// The buffer is fully drained here, so the next read reuses all of it.
+	m_begin = m_end = 0;
+	acquireBuffer();
+
+	size_t limit = static_cast<size_t>(std::min<uint64_t>(m_capacity, m_framer.getReadLimit()));
+	m_source->read(
+		getData(), limit,
+		[self](IoState *state) mutable
+		{
+			size_t count = state->getTransferCount();
+			if (count)
+			{
+				self->m_end = count;
+				self->continueBody();
+			}
+			else
+			{
+				self->m_framer.finish();
+				self->endBody(self->m_framer.isComplete());
+			}
+		}
+	);
+}
+
+void GatewayStreamPump::endBody(bool succeeded)
+{
+	handler_t handler = std::move(m_handler);
+	m_handler = nullptr;
+	m_source = nullptr;
+	m_sink = nullptr;
+	releaseBuffer();
+
+	handler(succeeded);
+}
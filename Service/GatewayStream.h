@@ -0,0 +1,313 @@
+#pragma once
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayMessageHead
+//
+// Start line and header fields of an HTTP/1.x message, parsed from the
+// raw bytes so that the message body can be relayed without buffering it.
+//
+
+class GatewayMessageHead
+{
+public:
+	using HeaderList = std::vector<std::pair<String, String>>;
+
+	static size_t FindEnd(const char *data, size_t length);
+
+	bool parse(const char *data, size_t length);
+	void clear();
+
+	bool isResponse() const;
+	bool isInterim() const;
+
+	const String &getMethod() const;
+	const String &getUri() const;
+	const String &getVersion() const;
+	int getStatusCode() const;
+
+	const HeaderList &getHeaders() const;
+	String getHeader(const char *name) const;
+	const String *findHeader(const char *name) const;
+	bool hasHeader(const char *name) const;
+	bool hasToken(const char *name, const char *token) const;
+
+	void setHeader(const char *name, const char *value);
+	void addHeader(const char *name, const char *value);
+	void removeHeader(const char *name);
+
+	void setUri(const char *uri);
+
+	bool isKeepAlive() const;
+
+	String format() const;
+
+private:
+	// Request: method, uri, version. Response: version, status, reason.
+	String m_startLine[3];
+	int m_statusCode{ 0 };
+
+	HeaderList m_headers;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayBodyFramer
+//
+// Tracks where a message body ends while its bytes pass through untouched.
+//
+
+class GatewayBodyFramer
+{
+public:
+	enum class Mode { NONE, LENGTH, CHUNKED, CLOSE };
+
+	static GatewayBodyFramer ForRequest(const GatewayMessageHead &head);
+	static GatewayBodyFramer ForResponse(const GatewayMessageHead &head, const char *requestMethod);
+
+	GatewayBodyFramer(Mode mode = Mode::NONE, uint64_t length = 0);
+
+	Mode getMode() const;
+	bool isValid() const;
+	bool isComplete() const;
+
+	// Upper bound of bytes that can be read without crossing the end of the body.
+	uint64_t getReadLimit() const;
+
+	// Returns the number of leading bytes in data that belong to the body.
+	size_t consume(const char *data, size_t length);
+
+	// Close-delimited bodies complete when the sender shuts down.
+	void finish();
+
+private:
+	enum class State { SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, TRAILER_LF, DONE, INVALID };
+
+	Mode m_mode;
+	State m_state;
+	uint64_t m_remaining;
+	bool m_hasSize{ false };
+
+	size_t consumeChunked(const char *data, size_t length);
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayStreamPump
+//
+// Cut-through copy of a message from one stream to another through a single
+// bounded buffer. The next read is only issued after the previous write has
+// completed, so a slow sink throttles the source. The buffer is checked out
+// of GatewayBufferPool only while it holds or awaits data.
+//
+
+class GatewayStreamPump : public RefCounter
+{
+public:
+	using handler_t = std::function<void(bool succeeded)>;
+
+	static const size_t MIN_BUFFER_SIZE = 16384;
+
+	GatewayStreamPump(size_t bufferSize = MIN_BUFFER_SIZE);
+	virtual ~GatewayStreamPump();
+
+	GatewayMessageHead &getHead();
+	const GatewayBodyFramer &getFramer() const;
+
+	bool isHeadSent() const;
+	bool isKeepAlive() const;
+	bool hasPendingData() const;
+
+	void readHead(NetStream *source, handler_t &&handler);
+	void writeHead(NetStream *sink, handler_t &&handler);
+	void writePending(NetStream *sink, handler_t &&handler);
+
+	// A null sink drains the body.
+	void pumpBody(NetStream *source, NetStream *sink, const GatewayBodyFramer &framer, handler_t &&handler);
+
+private:
+	char *m_buffer{ nullptr };
+	size_t m_capacity{ 0 };
+	size_t m_begin{ 0 };
+	size_t m_end{ 0 };
+
+	GatewayMessageHead m_head;
+	String m_headText;
+	bool m_headSent{ false };
+
+	GatewayBodyFramer m_framer;
+	NetStreamPtr m_source;
+	NetStreamPtr m_sink;
+	handler_t m_handler;
+
+	char *getData() const;
+	void acquireBuffer();
+	void releaseBuffer();
+
+	void continueHead(handler_t &&handler);
+	void continueBody();
+	void endBody(bool succeeded);
+};
+
+using GatewayStreamPumpPtr = RefPointer<GatewayStreamPump>;
+
+
+//////////////////////////////////////////////////////////////////////////
+// struct GatewayStreamSettings
+//
+
+struct GatewayStreamSettings
+{
+	// Read request heads directly and stream bodies to origin servers.
+	bool StreamRequests{ false };
+	size_t BufferSize{ GatewayStreamPump::MIN_BUFFER_SIZE };
+};
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline void GatewayMessageHead::clear()
+{
+	m_startLine[0].clear();
+	m_startLine[1].clear();
+	m_startLine[2].clear();
+	m_statusCode = 0;
+	m_headers.clear();
+}
+
+inline bool GatewayMessageHead::isResponse() const
+{
+	return m_statusCode != 0;
+}
+
+inline bool GatewayMessageHead::isInterim() const
+{
+	return (m_statusCode >= 100) && (m_statusCode < 200) && (m_statusCode != HttpStatus::SWITCH_PROTOCOLS);
+}
+
+inline const String &GatewayMessageHead::getMethod() const
+{
+	return m_startLine[0];
+}
+
+inline const String &GatewayMessageHead::getUri() const
+{
+	return m_startLine[1];
+}
+
+inline const String &GatewayMessageHead::getVersion() const
+{
+	return isResponse() ? m_startLine[0] : m_startLine[2];
+}
+
+inline int GatewayMessageHead::getStatusCode() const
+{
+	return m_statusCode;
+}
+
+inline const GatewayMessageHead::HeaderList &GatewayMessageHead::getHeaders() const
+{
+	return m_headers;
+}
+
+inline const String *GatewayMessageHead::findHeader(const char *name) const
+{
+	for (auto &header : m_headers)
+	{
+		if (header.first.compareNoCase(name) == 0)
+		{
+			return &header.second;
+		}
+	}
+	return nullptr;
+}
+
+inline bool GatewayMessageHead::hasHeader(const char *name) const
+{
+	return findHeader(name) != nullptr;
+}
+
+inline void GatewayMessageHead::addHeader(const char *name, const char *value)
+{
+	m_headers.emplace_back(name, value);
+}
+
+inline void GatewayMessageHead::setUri(const char *uri)
+{
+	m_startLine[1] = uri;
+}
+
+
+
+inline GatewayBodyFramer::GatewayBodyFramer(Mode mode, uint64_t length) :
+	m_mode(mode),
+	m_state(mode == Mode::CHUNKED ? State::SIZE : State::DATA),
+	m_remaining(length)
+{
+	if ((m_mode == Mode::NONE) || ((m_mode == Mode::LENGTH) && (m_remaining == 0)))
+	{
+		m_state = State::DONE;
+	}
+}
+
+inline GatewayBodyFramer::Mode GatewayBodyFramer::getMode() const
+{
+	return m_mode;
+}
+
+inline bool GatewayBodyFramer::isValid() const
+{
+	return m_state != State::INVALID;
+}
+
+inline bool GatewayBodyFramer::isComplete() const
+{
+	return m_state == State::DONE;
+}
+
+inline uint64_t GatewayBodyFramer::getReadLimit() const
+{
+	return m_mode == Mode::LENGTH ? m_remaining : UINT64_MAX;
+}
+
+inline void GatewayBodyFramer::finish()
+{
+	m_state = (m_mode == Mode::CLOSE) ? State::DONE : State::INVALID;
+}
+
+
+
+inline GatewayMessageHead &GatewayStreamPump::getHead()
+{
+	return m_head;
+}
+
+inline const GatewayBodyFramer &GatewayStreamPump::getFramer() const
+{
+	return m_framer;
+}
+
+inline bool GatewayStreamPump::isHeadSent() const
+{
+	return m_headSent;
+}
+
+inline bool GatewayStreamPump::isKeepAlive() const
+{
+	// After a 101, the connection no longer speaks HTTP.
+	return m_head.isKeepAlive() && (m_framer.getMode() != GatewayBodyFramer::Mode::CLOSE)
+		&& (m_head.getStatusCode() != HttpStatus::SWITCH_PROTOCOLS);
+}
+
+inline bool GatewayStreamPump::hasPendingData() const
+{
+	return m_begin < m_end;
+}
+
+inline char *GatewayStreamPump::getData() const
+{
+	return m_buffer;
+}
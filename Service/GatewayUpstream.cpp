@@ -0,0 +1,355 @@
+#include "pch.h"
+#include <random>
+#include "GatewayContext.h"
+#include "GatewayUpstream.h"
+
+
+static const String COOKIE_HEADER = "Cookie";
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayUpstream
+//
+
+SyncMutex GatewayUpstream::sm_upstreamMutex;
+std::set<GatewayUpstream*> GatewayUpstream::sm_upstreams;
+
+
+GatewayUpstream::GatewayUpstream(const String &labels, Policy policy, HashSource hashSource, const String &hashName) :
+	m_labels(labels),
+	m_policy(policy),
+	m_hashSource(hashSource),
+	m_hashName(hashName)
+{
+	SyncLock lock(sm_upstreamMutex);
+	sm_upstreams.insert(this);
+}
+
+GatewayUpstream::~GatewayUpstream()
+{
+	SyncLock lock(sm_upstreamMutex);
+	sm_upstreams.erase(this);
+}
+
+
+void GatewayUpstream::addMember(const String &target, unsigned weight, GatewayConnectionPool *pool)
+{
+	size_t index = m_members.size();
+
+	std::unique_ptr<Member> member(new Member);
+	member->m_labels.format("%s,target=\"%s\"", m_labels, target);
+	member->m_weight = weight ? weight : 1;
+	member->m_pool = pool;
+
+	// Points derive from the target alone, so members keep their keys when
+	// others come and go.
+	for (size_t point = 0; point < (member->m_weight * RING_POINTS); point++)
+	{
+		String name("%s#%u", target, static_cast<unsigned>(point));
+		m_ring.emplace_back(Hash(name, name.getLength()), index);
+	}
+	std::sort(m_ring.begin(), m_ring.end());
+
+	m_members.push_back(std::move(member));
+}
+
+
+size_t GatewayUpstream::select(GatewayContext *context)
+{
+	size_t index = 0;
+
+	if (m_members.size() > 1)
+	{
+		candidates_t candidates;
+		getCandidates(candidates);
+
+		switch (m_policy)
+		{
+		case Policy::ROUND_ROBIN:
+			index = selectRoundRobin(candidates);
+			break;
+
+		case Policy::LEAST_REQUESTS:
+			index = selectLeastRequests(candidates);
+			break;
+
+		case Policy::LATENCY:
+			index = selectByLatency(candidates);
+			break;
+
+		case Policy::HASH:
+			index = selectByHash(context, candidates);
+			break;
+		}
+	}
+
+	m_members[index]->m_selectCount++;
+	return index;
+}
+
+void GatewayUpstream::getCandidates(candidates_t &candidates) const
+{
+	candidates.reserve(m_members.size());
+
+	for (size_t index = 0; index < m_members.size(); index++)
+	{
+		GatewayOriginHealth &health = m_members[index]->m_pool->getHealth();
+		if (health.isAvailable())
+		{
+			candidates.push_back({ index, m_members[index]->m_weight * health.getRampPercent() });
+		}
+	}
+
+	// With none available, the request fails fast on whichever is picked.
+	if (candidates.empty())
+	{
+		for (size_t index = 0; index < m_members.size(); index++)
+		{
+			candidates.push_back({ index, m_members[index]->m_weight * 100ul });
+		}
+	}
+}
+
+size_t GatewayUpstream::selectRoundRobin(const candidates_t &candidates)
+{
+	SyncLock lock(m_mutex);
+
+	// Smooth weighted round-robin: heavier members are picked more often,
+	// but never many times in a row.
+	long totalShare = 0;
+	Member *best = nullptr;
+	size_t bestIndex = 0;
+
+	for (const Candidate &candidate : candidates)
+	{
+		Member &member = *m_members[candidate.m_index];
+		member.m_currentWeight += candidate.m_share;
+		totalShare += candidate.m_share;
+
+		if (!best || (member.m_currentWeight > best->m_currentWeight))
+		{
+			best = &member;
+			bestIndex = candidate.m_index;
+		}
+	}
+
+	best->m_currentWeight -= totalShare;
+	return bestIndex;
+}
+
+size_t GatewayUpstream::selectLeastRequests(const candidates_t &candidates)
+{
+	// Start at a rotating candidate, so ties are spread.
+	size_t count = candidates.size();
+	size_t start = m_nextMember++ % count;
+
+	size_t best = 0;
+	double bestCost = 0;
+
+	for (size_t offset = 0; offset < count; offset++)
+	{
+		const Candidate &candidate = candidates[(start + offset) % count];
+
+		double cost = static_cast<double>(m_members[candidate.m_index]->m_pool->getLoad() + 1) / candidate.m_share;
+		if ((offset == 0) || (cost < bestCost))
+		{
+			best = candidate.m_index;
+			bestCost = cost;
+		}
+	}
+
+	return best;
+}
+
+size_t GatewayUpstream::selectByLatency(const candidates_t &candidates)
+{
+	static thread_local std::minstd_rand random(
+		static_cast<unsigned>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+
+	size_t count = candidates.size();
+	if (count == 1)
+	{
+		return candidates[0].m_index;
+	}
+
+	// Power of two choices: the cheaper of two random candidates, where
+	// members without samples yet cost nothing so they get some.
+	size_t first = random() % count;
+	size_t second = random() % (count - 1);
+	if (second >= first)
+	{
+		second++;
+	}
+
+	auto cost =
+		[this, &candidates](size_t position)
+		{
+			const Candidate &candidate = candidates[position];
+			GatewayConnectionPool *pool = m_members[candidate.m_index]->m_pool;
+			return static_cast<double>(pool->getLatency()) * (pool->getLoad() + 1) / candidate.m_share;
+		};
+
+	return candidates[(cost(second) < cost(first)) ? second : first].m_index;
+}
+
+size_t GatewayUpstream::selectByHash(GatewayContext *context, const candidates_t &candidates)
+{
+	String key = getHashKey(context);
+	if (key.isEmpty())
+	{
+		return selectRoundRobin(candidates);
+	}
+
+	std::vector<bool> eligible(m_members.size());
+	for (const Candidate &candidate : candidates)
+	{
+		eligible[candidate.m_index] = true;
+	}
+
+	// The first eligible point at or after the key's, wrapping around, so a
+	// member's keys move only while it is out of rotation.
+	uint32_t point = Hash(key, key.getLength());
+	size_t position = std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(point, static_cast<size_t>(0))) - m_ring.begin();
+
+	for (size_t offset = 0; offset < m_ring.size(); offset++)
+	{
+		size_t index = m_ring[(position + offset) % m_ring.size()].second;
+		if (eligible[index])
+		{
+			return index;
+		}
+	}
+
+	return candidates[0].m_index;
+}
+
+
+String GatewayUpstream::getHashKey(GatewayContext *context) const
+{
+	switch (m_hashSource)
+	{
+	case HashSource::HEADER:
+		return context->request.getHeader(m_hashName);
+
+	case HashSource::COOKIE:
+		{
+			String cookies = context->request.getHeader(COOKIE_HEADER);
+			const char *cursor = cookies;
+			const char *end = cursor + cookies.getLength();
+			size_t nameLength = m_hashName.getLength();
+
+			while (cursor < end)
+			{
+				while ((cursor < end) && ((*cursor == ' ') || (*cursor == ';')))
+				{
+					cursor++;
+				}
+
+				const char *valueEnd = cursor;
+				while ((valueEnd < end) && (*valueEnd != ';'))
+				{
+					valueEnd++;
+				}
+
+				if ((static_cast<size_t>(valueEnd - cursor) > nameLength)
+					&& (strncmp(cursor, m_hashName, nameLength) == 0) && (cursor[nameLength] == '='))
+				{
+					return String(cursor + nameLength + 1, valueEnd - cursor - nameLength - 1);
+				}
+
+				cursor = valueEnd;
+			}
+
+			return String();
+		}
+
+	case HashSource::CLIENT_ADDRESS:
+		{
+			// "1.2.3.4:port", "[::1]:port", or a bare address; only the port
+			// is dropped, so IPv6 clients keep distinct keys.
+			String address = context->getStream()->getRemoteAddress();
+			const char *text = address;
+			size_t length = address.getLength();
+
+			if (*text == '[')
+			{
+				const char *end = static_cast<const char *>(memchr(text, ']', length));
+				return end ? String(text + 1, end - text - 1) : address;
+			}
+
+			const char *colon = strchr(text, ':');
+			if (colon && !strchr(colon + 1, ':'))
+			{
+				return String(text, colon - text);
+			}
+			return address;
+		}
+	}
+
+	return String();
+}
+
+
+bool GatewayUpstream::ParsePolicy(const String &name, Policy &policy)
+{
+	if (name.isEmpty() || (name.compareNoCase("round-robin") == 0))
+	{
+		policy = Policy::ROUND_ROBIN;
+	}
+	else if (name.compareNoCase("least-requests") == 0)
+	{
+		policy = Policy::LEAST_REQUESTS;
+	}
+	else if (name.compareNoCase("latency") == 0)
+	{
+		policy = Policy::LATENCY;
+	}
+	else if (name.compareNoCase("hash") == 0)
+	{
+		policy = Policy::HASH;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+uint32_t GatewayUpstream::Hash(const char *data, size_t length)
+{
+	// FNV-1a, then a finalizer so nearby keys land far apart on the ring.
+	uint32_t hash = 2166136261u;
+	for (size_t index = 0; index < length; index++)
+	{
+		hash = (hash ^ static_cast<unsigned char>(data[index])) * 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+
+void GatewayUpstream::WriteMetrics(GatewayMetrics::Writer &writer)
+{
+	SyncLock registryLock(sm_upstreamMutex);
+
+	for (GatewayUpstream *upstream : sm_upstreams)
+	{
+		for (auto &member : upstream->m_members)
+		{
+			const char *labels = member->m_labels;
+			writer.add("gateway_upstream_selected", member->m_selectCount, labels);
+			writer.add("gateway_upstream_weight", member->m_weight, labels);
+			writer.add("gateway_upstream_load", member->m_pool->getLoad(), labels);
+			writer.add("gateway_upstream_latency_microseconds", member->m_pool->getLatency(), labels);
+		}
+	}
+}
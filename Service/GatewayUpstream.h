@@ -0,0 +1,113 @@
+#pragma once
+#include "GatewayConnectionPool.h"
+
+
+class GatewayContext;
+
+
+//////////////////////////////////////////////////////////////////////////
+// class GatewayUpstream
+//
+// A group of origins serving the same content, each with its own pool, and
+// the policy that picks one per request: weighted round-robin, fewest
+// outstanding requests, the cheaper of two random members by latency, or
+// a consistent hash of a header, cookie or the client address so the same
+// key keeps reaching the same member. Members whose origin is out of
+// rotation are passed over, and those coming back are given a growing part
+// of their weight, unless none is available.
+//
+
+class GatewayUpstream : public RefCounter
+{
+public:
+	enum class Policy
+	{
+		ROUND_ROBIN,
+		LEAST_REQUESTS,
+		LATENCY,
+		HASH
+	};
+
+	enum class HashSource
+	{
+		HEADER,
+		COOKIE,
+		CLIENT_ADDRESS
+	};
+
+	GatewayUpstream(const String &labels, Policy policy, HashSource hashSource = HashSource::CLIENT_ADDRESS, const String &hashName = String());
+	virtual ~GatewayUpstream();
+
+	static const unsigned MAX_WEIGHT = 100;
+
+	// Members are added before the first request.
+	void addMember(const String &target, unsigned weight, GatewayConnectionPool *pool);
+	size_t getMemberCount() const;
+
+	size_t select(GatewayContext *context);
+
+	static bool ParsePolicy(const String &name, Policy &policy);
+
+	static void WriteMetrics(GatewayMetrics::Writer &writer);
+
+private:
+	struct Member
+	{
+		String m_labels;
+		unsigned m_weight;
+		GatewayConnectionPoolPtr m_pool;
+
+		long m_currentWeight{ 0 };			// smooth weighted round-robin
+		std::atomic<uint64_t> m_selectCount{ 0 };
+	};
+
+	// A member in the running for a request, and its weight in percent.
+	struct Candidate
+	{
+		size_t m_index;
+		unsigned long m_share;
+	};
+
+	using candidates_t = std::vector<Candidate>;
+
+	// Points per unit of weight on the hash ring.
+	static const size_t RING_POINTS = 64;
+
+	String m_labels;
+	Policy m_policy;
+	HashSource m_hashSource;
+	String m_hashName;
+
+	std::vector<std::unique_ptr<Member>> m_members;
+	std::vector<std::pair<uint32_t, size_t>> m_ring;	// sorted by point
+
+	SyncMutex m_mutex;
+	std::atomic<size_t> m_nextMember{ 0 };
+
+	static SyncMutex sm_upstreamMutex;
+	static std::set<GatewayUpstream*> sm_upstreams;
+
+	void getCandidates(candidates_t &candidates) const;
+
+	size_t selectRoundRobin(const candidates_t &candidates);
+	size_t selectLeastRequests(const candidates_t &candidates);
+	size_t selectByLatency(const candidates_t &candidates);
+	size_t selectByHash(GatewayContext *context, const candidates_t &candidates);
+
+	String getHashKey(GatewayContext *context) const;
+
+	static uint32_t Hash(const char *data, size_t length);
+};
+
+using GatewayUpstreamPtr = RefPointer<GatewayUpstream>;
+
+
+
+/*
+* Inline Implementations
+*/
+
+inline size_t GatewayUpstream::getMemberCount() const
+{
+	return m_members.size();
+}